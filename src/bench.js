@@ -0,0 +1,362 @@
+// copyright defined in LICENSE.txt
+
+'use strict';
+
+// Performance suite. Run from the build directory, like test-client.js.
+//
+//   node ../src/bench.js seed [--scale N]
+//       Replaces the chain schema in the database which the PG* environment variables select with
+//       synthetic data, then loads init.sql. Needs psql. Don't point this at a real database.
+//
+//   node ../src/bench.js run [--endpoint URL] [--concurrency N] [--duration S] [--warmup S]
+//                            [--scale N] [--only NAME,...] [--baseline FILE] [--tolerance F]
+//       Drives each scenario at a fixed concurrency and prints one json object per scenario:
+//       requests, errors, qps and latency percentiles in ms. With --baseline (a previous run's
+//       output) it exits with status 1 if any scenario's qps fell or p99 rose by more than
+//       tolerance (default 0.1).
+
+const fs = require('fs');
+const http = require('http');
+const { execFileSync } = require('child_process');
+const fetch = require('node-fetch');
+const { ClientWasm } = require('./client-wasm');
+const { type_map } = require('./sql-types');
+
+const schema = 'chain';
+
+function parse_args(argv) {
+    const opts = {
+        command: argv[0],
+        endpoint: 'http://127.0.0.1:8880',
+        concurrency: 16,
+        duration: 10,
+        warmup: 2,
+        scale: 1,
+        only: null,
+        baseline: null,
+        tolerance: 0.1,
+    };
+    for (let i = 1; i < argv.length; i += 2) {
+        const key = argv[i].replace(/^--/, '');
+        if (!(key in opts) || key === 'command' || i + 1 >= argv.length)
+            throw new Error('bad argument: ' + argv[i]);
+        const value = argv[i + 1];
+        if (typeof opts[key] === 'number')
+            opts[key] = +value;
+        else if (key === 'only')
+            opts[key] = value.split(',');
+        else
+            opts[key] = value;
+    }
+    return opts;
+}
+
+// Row counts at scale 1. Action traces and token balances dominate a real chain, and every
+// account's balance has a few versions so the history searches have work to do.
+function sizes(scale) {
+    return {
+        blocks: 100000 * scale,
+        actions_per_block: 10,
+        accounts: 10000 * scale,
+        versions: 3,
+        voters: 10000 * scale,
+    };
+}
+
+// A valid, distinct name for each n below 10^7, e.g. benchaaaaaab
+function account_name(n) {
+    return 'bench' + String(n).padStart(7, '0').replace(/[0-9]/g, d => 'abcdefghij'[d]);
+}
+
+const sql_account_name = n => `'bench' || translate(lpad((${n})::text, 7, '0'), '0123456789', 'abcdefghij')`;
+const sql_checksum = (...parts) => `md5(${parts.join(` || ':' || `)}) || md5(${parts.join(` || ';' || `)})`;
+
+// fill-postgresql's primary keys; the indexes in init.sql cover the query shapes
+const primary_keys = {
+    block_info: ['block_index'],
+    action_trace: ['block_index', 'transaction_id', 'action_index'],
+};
+
+function create_tables_sql(config) {
+    let sql = `
+        drop schema if exists ${schema} cascade;
+        create schema ${schema};
+        create type ${schema}.transaction_status_type as enum('executed', 'soft_fail', 'hard_fail', 'delayed', 'expired');
+        set search_path to ${schema}, public;
+        create table ${schema}.fill_status(head bigint, head_id varchar(64), irreversible bigint, irreversible_id varchar(64), first bigint);
+    `;
+    for (let table of config.tables)
+        sql += `
+        create table ${schema}.${table.name}(
+            ${table.fields.map(f => `"${f.name}" ${type_map[f.type]}`).join(',\n            ')}
+        );`;
+    return sql;
+}
+
+function primary_keys_sql(config) {
+    let sql = '';
+    for (let table of config.tables) {
+        const keys = primary_keys[table.name] || [...(table.keys || []), ...(table.history_keys || [])].map(k => k.name);
+        sql += `
+        alter table ${schema}.${table.name} add primary key(${keys.map(k => `"${k}"`).join(', ')});`;
+    }
+    return sql;
+}
+
+function fill_tables_sql(s) {
+    const head = s.blocks;
+    const irreversible = s.blocks - 300;
+    const EOS = '5459781'; // symbol_code("EOS")
+    return `
+        set search_path to ${schema}, public;
+
+        -- little-endian int64, as abieos serializes it
+        create function pg_temp.le64(v bigint) returns bytea as $$
+            select decode(string_agg(substr(lpad(to_hex(v), 16, '0'), 15 - 2 * i, 2), '' order by i), 'hex')
+            from generate_series(0, 7) i
+        $$ language sql immutable;
+
+        insert into ${schema}.block_info
+        select
+            b, ${sql_checksum("'block'", 'b')}, timestamp '2018-06-14' + b * interval '0.5 second',
+            ${sql_account_name('b % 21')}, 0, ${sql_checksum("'block'", 'b - 1')},
+            ${sql_checksum("'trx'", 'b')}, ${sql_checksum("'act'", 'b')}, b / 100000, 0
+        from generate_series(1, ${s.blocks}) b;
+
+        insert into ${schema}.action_trace
+        select
+            b, ${sql_checksum("'trx'", 'b')}, a, 0, 'executed',
+            ${sql_account_name(`(b * ${s.actions_per_block} + a) % ${s.accounts}`)}, ${sql_checksum("'digest'", 'b', 'a')},
+            b * ${s.actions_per_block} + a, b, 1, 1,
+            'eosio.token', 'transfer', decode(md5(b::text || a::text) || md5(a::text || b::text), 'hex'), false, 100 + a
+        from generate_series(1, ${s.blocks}) b, generate_series(0, ${s.actions_per_block - 1}) a;
+
+        insert into ${schema}.account
+        select
+            1 + (n * 7919 + v * 104729) % ${irreversible}, true, ${sql_account_name('n')}, 0, 0, false,
+            timestamp '2018-06-14', repeat('0', 64), timestamp '2018-06-14', ''::bytea, ''::bytea
+        from generate_series(0, ${s.accounts - 1}) n, generate_series(0, ${s.versions - 1}) v;
+
+        insert into ${schema}.contract_row
+        select
+            1 + (n * 7919 + v * 104729) % ${head}, true, 'eosio.token', ${sql_account_name('n')}, 'accounts', ${EOS},
+            ${sql_account_name('n')}, pg_temp.le64(n * 10000 + v) || decode('04454f5300000000', 'hex')
+        from generate_series(0, ${s.accounts - 1}) n, generate_series(0, ${s.versions - 1}) v;
+
+        insert into ${schema}.contract_row
+        select
+            1 + (n * 7919) % ${head}, true, 'eosio', 'eosio', 'voters', n, ${sql_account_name('n')},
+            decode(md5(n::text) || md5((n + 1)::text) || md5((n + 2)::text), 'hex')
+        from generate_series(0, ${s.voters - 1}) n;
+
+        insert into ${schema}.contract_index64
+        select 1 + (n * 7919) % ${head}, true, 'eosio', 'eosio', 'voters', n, ${sql_account_name('n')}, (n * 2654435761) % 4294967296
+        from generate_series(0, ${s.voters - 1}) n;
+
+        insert into ${schema}.fill_status
+        values (${head}, ${sql_checksum("'block'", head)}, ${irreversible}, ${sql_checksum("'block'", irreversible)}, 1);
+    `;
+}
+
+function psql(sql) {
+    execFileSync('psql', ['-q', '-v', 'ON_ERROR_STOP=1'], { input: sql, stdio: ['pipe', 'inherit', 'inherit'] });
+}
+
+function seed(opts) {
+    const config = JSON.parse(fs.readFileSync('../src/query-config.json', 'utf8'));
+    const s = sizes(opts.scale);
+    let start = Date.now();
+    psql(create_tables_sql(config));
+    psql(fill_tables_sql(s));
+    psql(primary_keys_sql(config));
+    psql(`set search_path to ${schema}, public;\n` + fs.readFileSync('../src/init.sql', 'utf8'));
+    psql(`analyze;`);
+    console.error(`seeded ${JSON.stringify(s)} in ${(Date.now() - start) / 1000} s`);
+}
+
+// Deterministic, so runs against the same seed send the same requests
+function make_random(seed) {
+    let x = seed;
+    return n => {
+        x = (Math.imul(x, 1103515245) + 12345) >>> 0;
+        return (x >>> 1) % n;
+    };
+}
+
+// Each scenario has a fixed pool of request bodies which the workers cycle through
+function scenarios(opts) {
+    const s = sizes(opts.scale);
+    const random = make_random(42);
+    const pool = make => Array.from({ length: 256 }, make);
+    const chain = new ClientWasm('./chain-client.wasm');
+    const token = new ClientWasm('./token-client.wasm');
+    const get_table_rows = params => JSON.stringify({ json: false, limit: 10, ...params });
+    return [
+        {
+            name: 'block.info',
+            target: '/wasmql/v1/query',
+            bodies: pool(() => {
+                const first = 1 + random(s.blocks - 100);
+                return chain.query_body(['block.info', { first: ['absolute', first], last: ['absolute', first + 9], max_results: 10 }]);
+            }),
+        },
+        {
+            name: 'account',
+            target: '/wasmql/v1/query',
+            bodies: pool(() => {
+                const n = random(s.accounts - 10);
+                return chain.query_body(['account', {
+                    max_block: ['irreversible', 0],
+                    first: account_name(n),
+                    last: account_name(n + 9),
+                    max_results: 10,
+                    include_code: false,
+                    include_abi: false,
+                }]);
+            }),
+        },
+        {
+            name: 'bal.mult.acc',
+            target: '/wasmql/v1/query',
+            bodies: pool(() => {
+                const n = random(s.accounts - 10);
+                return token.query_body(['bal.mult.acc', {
+                    max_block: ['head', 0],
+                    code: 'eosio.token',
+                    sym: 'EOS',
+                    first_account: account_name(n),
+                    last_account: account_name(n + 9),
+                    max_results: 10,
+                }]);
+            }),
+        },
+        {
+            name: 'get_table_rows.primary',
+            target: '/v1/chain/get_table_rows',
+            bodies: pool(() => get_table_rows({ code: 'eosio.token', scope: account_name(random(s.accounts)), table: 'accounts' })),
+        },
+        {
+            name: 'get_table_rows.secondary',
+            target: '/v1/chain/get_table_rows',
+            bodies: pool(() => get_table_rows({
+                code: 'eosio',
+                scope: 'eosio',
+                table: 'voters',
+                index_position: '2',
+                key_type: 'i64',
+                lower_bound: String(random(4294967296)),
+            })),
+        },
+    ].filter(x => !opts.only || opts.only.includes(x.name));
+}
+
+function percentile(sorted, p) {
+    if (!sorted.length)
+        return 0;
+    return sorted[Math.min(sorted.length - 1, Math.floor(sorted.length * p))];
+}
+
+async function run_scenario(opts, agent, scenario) {
+    const latencies = [];
+    let errors = 0;
+    let next = 0;
+    const start = Date.now();
+    const warmup_end = start + opts.warmup * 1000;
+    const end = warmup_end + opts.duration * 1000;
+
+    async function worker() {
+        while (Date.now() < end) {
+            const body = scenario.bodies[next++ % scenario.bodies.length];
+            const recording = Date.now() >= warmup_end;
+            const t = process.hrtime.bigint();
+            let ok = false;
+            try {
+                const reply = await fetch(opts.endpoint + scenario.target, { method: 'POST', body, agent });
+                await reply.arrayBuffer();
+                ok = reply.status === 200;
+            } catch (e) {
+            }
+            if (!recording)
+                continue;
+            if (ok)
+                latencies.push(Number(process.hrtime.bigint() - t) / 1e6);
+            else
+                ++errors;
+        }
+    }
+
+    await Promise.all(Array.from({ length: opts.concurrency }, worker));
+    latencies.sort((a, b) => a - b);
+    const round = x => Math.round(x * 1000) / 1000;
+    return {
+        name: scenario.name,
+        target: scenario.target,
+        concurrency: opts.concurrency,
+        duration: opts.duration,
+        requests: latencies.length,
+        errors,
+        qps: round(latencies.length / opts.duration),
+        latency_ms: {
+            p50: round(percentile(latencies, 0.5)),
+            p99: round(percentile(latencies, 0.99)),
+            p999: round(percentile(latencies, 0.999)),
+            max: round(percentile(latencies, 1)),
+        },
+    };
+}
+
+// Returns descriptions of the regressions
+function compare(results, baseline_file, tolerance) {
+    const baseline = {};
+    for (let line of fs.readFileSync(baseline_file, 'utf8').split('\n'))
+        if (line.trim()) {
+            const r = JSON.parse(line);
+            baseline[r.name] = r;
+        }
+    const regressions = [];
+    for (let r of results) {
+        const b = baseline[r.name];
+        if (!b)
+            continue;
+        if (r.qps < b.qps * (1 - tolerance))
+            regressions.push(`${r.name}: qps ${b.qps} -> ${r.qps}`);
+        if (r.latency_ms.p99 > b.latency_ms.p99 * (1 + tolerance))
+            regressions.push(`${r.name}: p99 ${b.latency_ms.p99} ms -> ${r.latency_ms.p99} ms`);
+        if (r.errors && !b.errors)
+            regressions.push(`${r.name}: ${r.errors} errors`);
+    }
+    return regressions;
+}
+
+async function run(opts) {
+    const agent = new http.Agent({ keepAlive: true, maxSockets: opts.concurrency });
+    const results = [];
+    for (let scenario of scenarios(opts)) {
+        const result = await run_scenario(opts, agent, scenario);
+        console.log(JSON.stringify(result));
+        results.push(result);
+    }
+    agent.destroy();
+    if (opts.baseline) {
+        const regressions = compare(results, opts.baseline, opts.tolerance);
+        for (let r of regressions)
+            console.error('regression: ' + r);
+        if (regressions.length)
+            process.exitCode = 1;
+    }
+}
+
+(async () => {
+    try {
+        const opts = parse_args(process.argv.slice(2));
+        if (opts.command === 'seed')
+            seed(opts);
+        else if (opts.command === 'run')
+            await run(opts);
+        else
+            throw new Error('usage: bench.js seed|run [options]');
+    } catch (e) {
+        console.error(e);
+        process.exitCode = 1;
+    }
+})();
@@ -3,35 +3,9 @@
 'use strict';
 
 const fs = require('fs');
+const { type_map } = require('./sql-types');
 const schema = 'chain';
 
-const type_map = {
-    'bool': 'bool',
-    'varuint32': 'bigint',
-    'varint32': 'integer',
-    'uint8': 'smallint',
-    'uint16': 'integer',
-    'uint32': 'bigint',
-    'uint64': 'decimal',
-    'uint128': 'decimal',
-    'int8': 'smallint',
-    'int16': 'smallint',
-    'int32': 'integer',
-    'int64': 'bigint',
-    'int128': 'decimal',
-    'double': 'float8',
-    'float128': 'bytea',
-    'name': 'varchar(13)',
-    'string': 'varchar',
-    'time_point': 'timestamp',
-    'time_point_sec': 'timestamp',
-    'block_timestamp_type': 'timestamp',
-    'checksum256': 'varchar(64)',
-    'public_key': 'varchar',
-    'bytes': 'bytea',
-    'transaction_status': 'transaction_status_type',
-};
-
 const empty_value_map = {
     "bool": "false",
     "varuint32": "0",
@@ -1,7 +1,30 @@
 // copyright defined in LICENSE.txt
 
+// Instances are reused across requests. The initial contents of linear memory are captured once per
+// module and copied back after each successful run, which is far cheaper than instantiating. An
+// instance which threw is discarded since its globals (e.g. the stack pointer) may be inconsistent.
+// Each context runs one request at a time, so one idle instance per module is enough.
+const max_reused_memory = 16 * 1024 * 1024;
+
 let modules = {};
+let modules_generation = 0; // the host bumps its generation when the wasms on disk are reloaded
 let inst;
+let memory_limit = 0; // bytes of linear memory the current query may use; 0 is unlimited
+
+// Growth happens inside the wasm, so this runs whenever control comes back to the host
+function check_memory() {
+    if (memory_limit && inst.exports.memory.buffer.byteLength > memory_limit)
+        throw new Error('memory limit exceeded');
+}
+
+function alloc_callback(cb_alloc_data, cb_alloc) {
+    return size => {
+        // cb_alloc may resize memory, causing inst.exports.memory.buffer to change
+        let ptr = inst.exports.__indirect_function_table.get(cb_alloc)(cb_alloc_data, size);
+        check_memory();
+        return [inst.exports.memory.buffer, ptr];
+    };
+}
 
 const env = {
     abort() {
@@ -22,43 +45,99 @@ const env = {
         throw new Error('called set_blockchain_parameters_packed'); // todo: remove
     },
     get_context_data(cb_alloc_data, cb_alloc) {
-        get_context_data(size => {
-            // cb_alloc may resize memory, causing inst.exports.memory.buffer to change
-            let ptr = inst.exports.__indirect_function_table.get(cb_alloc)(cb_alloc_data, size);
-            return [inst.exports.memory.buffer, ptr];
-        });
+        get_context_data(alloc_callback(cb_alloc_data, cb_alloc));
     },
     get_input_data(cb_alloc_data, cb_alloc) {
-        get_input_data(size => {
-            // cb_alloc may resize memory, causing inst.exports.memory.buffer to change
-            let ptr = inst.exports.__indirect_function_table.get(cb_alloc)(cb_alloc_data, size);
-            return [inst.exports.memory.buffer, ptr];
-        });
+        get_input_data(alloc_callback(cb_alloc_data, cb_alloc));
     },
     set_output_data(begin, end) {
+        check_memory();
         set_output_data(inst.exports.memory.buffer, begin, end);
     },
+    append_output_data(begin, end) {
+        check_memory();
+        append_output_data(inst.exports.memory.buffer, begin, end);
+    },
     exec_query(req_begin, req_end, cb_alloc_data, cb_alloc) {
-        exec_query(inst.exports.memory.buffer, req_begin, req_end, size => {
-            // cb_alloc may resize memory, causing inst.exports.memory.buffer to change
-            let ptr = inst.exports.__indirect_function_table.get(cb_alloc)(cb_alloc_data, size);
-            return [inst.exports.memory.buffer, ptr];
-        });
+        exec_query(inst.exports.memory.buffer, req_begin, req_end, alloc_callback(cb_alloc_data, cb_alloc));
+    },
+    query_open(req_begin, req_end, batch_size) {
+        check_memory();
+        return query_open(inst.exports.memory.buffer, req_begin, req_end, batch_size >>> 0);
+    },
+    query_next(cursor, max_rows, cb_alloc_data, cb_alloc) {
+        return query_next(cursor >>> 0, max_rows >>> 0, alloc_callback(cb_alloc_data, cb_alloc));
+    },
+    query_close(cursor) {
+        query_close(cursor >>> 0);
+    },
+    abi_prepare(begin, end) {
+        check_memory();
+        return abi_prepare(inst.exports.memory.buffer, begin, end);
+    },
+    abi_table_to_json(begin, end, abi, cb_alloc_data, cb_alloc) {
+        return abi_table_to_json(inst.exports.memory.buffer, begin, end, abi >>> 0, alloc_callback(cb_alloc_data, cb_alloc));
     },
     print_range(begin, end) {
         print_wasm_str(inst.exports.memory.buffer, begin, end);
     },
 };
 
-function query(wasm_name) {
+// The host compiles each wasm once per process and shares the code between contexts
+function get_module(wasm_name) {
+    let m = modules[wasm_name];
+    if (!m) {
+        m = { module: get_wasm_module(wasm_name), initial_memory: null, idle: null };
+        modules[wasm_name] = m;
+    }
+    return m;
+}
+
+function acquire_instance(m) {
+    let instance = m.idle;
+    m.idle = null;
+    if (!instance) {
+        instance = new WebAssembly.Instance(m.module, { env });
+        if (!m.initial_memory)
+            m.initial_memory = new Uint8Array(instance.exports.memory.buffer).slice();
+    }
+    return instance;
+}
+
+function release_instance(m, instance) {
+    let memory = new Uint8Array(instance.exports.memory.buffer);
+    if (memory.length > max_reused_memory)
+        return;
+    memory.set(m.initial_memory);
+    memory.fill(0, m.initial_memory.length);
+    m.idle = instance;
+}
+
+// A query which runs out of time is terminated without unwinding, so nothing here sees it; its
+// instance was already taken out of m.idle and is simply dropped.
+function query(wasm_name, max_memory, generation) {
     try {
-        if (!modules[wasm_name])
-            modules[wasm_name] = new WebAssembly.Module(get_wasm(wasm_name));
-        inst = new WebAssembly.Instance(modules[wasm_name], { env });
+        if (generation !== modules_generation) {
+            modules = {};
+            modules_generation = generation;
+        }
+        let m = get_module(wasm_name);
+        memory_limit = max_memory;
+        trace_begin('instantiate');
+        inst = acquire_instance(m);
+        trace_end();
+        trace_begin('run');
         inst.exports.startup();
+        check_memory();
+        trace_end();
+        trace_begin('reset_memory');
+        release_instance(m, inst);
+        trace_end();
     } catch (e) {
         print_js_str('Caught: ' + e + '\n');
         throw e;
+    } finally {
+        inst = null;
     }
 }
 
@@ -0,0 +1,189 @@
+// copyright defined in LICENSE.txt
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define HEX_CODEC_X86 1
+#include <immintrin.h>
+#endif
+
+// Hex encoding and decoding into buffers the caller has already sized. The output matches
+// abieos::hex (upper case); decoding accepts either case. On x86-64 the widest of AVX2, SSE4.1 and
+// plain scalar code which the CPU supports is picked on first use.
+namespace hex_codec {
+
+namespace scalar {
+
+inline void encode(char* dest, const unsigned char* src, size_t size) {
+    static const char digits[] = "0123456789ABCDEF";
+    for (size_t i = 0; i < size; ++i) {
+        dest[i * 2]     = digits[src[i] >> 4];
+        dest[i * 2 + 1] = digits[src[i] & 0xf];
+    }
+}
+
+// -1 if ch isn't a hex digit
+inline int nibble(char ch) {
+    if (ch >= '0' && ch <= '9')
+        return ch - '0';
+    if (ch >= 'a' && ch <= 'f')
+        return ch - 'a' + 10;
+    if (ch >= 'A' && ch <= 'F')
+        return ch - 'A' + 10;
+    return -1;
+}
+
+// Decodes size bytes from 2 * size hex digits. Returns false if there's a non-hex character, in
+// which case dest holds garbage.
+inline bool decode(unsigned char* dest, const char* src, size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+        int hi = nibble(src[i * 2]);
+        int lo = nibble(src[i * 2 + 1]);
+        if ((hi | lo) < 0)
+            return false;
+        dest[i] = (hi << 4) | lo;
+    }
+    return true;
+}
+
+} // namespace scalar
+
+#ifdef HEX_CODEC_X86
+
+namespace sse {
+
+// 16 bytes -> 32 digits, high nibble first
+__attribute__((target("sse4.1"))) inline void encode_block(char* dest, __m128i in) {
+    const __m128i digits = _mm_setr_epi8('0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'A', 'B', 'C', 'D', 'E', 'F');
+    const __m128i mask   = _mm_set1_epi8(0xf);
+    __m128i       hi     = _mm_shuffle_epi8(digits, _mm_and_si128(_mm_srli_epi16(in, 4), mask));
+    __m128i       lo     = _mm_shuffle_epi8(digits, _mm_and_si128(in, mask));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dest), _mm_unpacklo_epi8(hi, lo));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + 16), _mm_unpackhi_epi8(hi, lo));
+}
+
+__attribute__((target("sse4.1"))) inline void encode(char* dest, const unsigned char* src, size_t size) {
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16)
+        encode_block(dest + i * 2, _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i)));
+    scalar::encode(dest + i * 2, src + i, size - i);
+}
+
+// 16 digits -> 16 nibbles; valid is all ones where the digit was a hex digit
+__attribute__((target("sse4.1"))) inline __m128i nibbles(__m128i ch, __m128i& valid) {
+    // bytes >= 0x80 are negative, so they fail both range checks
+    __m128i lower    = _mm_or_si128(ch, _mm_set1_epi8(0x20));
+    __m128i is_digit = _mm_and_si128(_mm_cmpgt_epi8(ch, _mm_set1_epi8('0' - 1)), _mm_cmplt_epi8(ch, _mm_set1_epi8('9' + 1)));
+    __m128i is_alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(lower, _mm_set1_epi8('f' + 1)));
+    valid            = _mm_and_si128(valid, _mm_or_si128(is_digit, is_alpha));
+    return _mm_blendv_epi8(_mm_sub_epi8(lower, _mm_set1_epi8('a' - 10)), _mm_sub_epi8(ch, _mm_set1_epi8('0')), is_digit);
+}
+
+__attribute__((target("sse4.1"))) inline bool decode(unsigned char* dest, const char* src, size_t size) {
+    // each pair of nibbles (hi, lo) becomes hi * 16 + lo in a 16-bit lane
+    const __m128i weights = _mm_set1_epi16(0x0110);
+    __m128i       valid   = _mm_set1_epi8(-1);
+    size_t        i       = 0;
+    for (; i + 16 <= size; i += 16) {
+        __m128i a      = nibbles(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 2)), valid);
+        __m128i b      = nibbles(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 2 + 16)), valid);
+        __m128i packed = _mm_packus_epi16(_mm_maddubs_epi16(a, weights), _mm_maddubs_epi16(b, weights));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + i), packed);
+    }
+    return _mm_movemask_epi8(valid) == 0xffff && scalar::decode(dest + i, src + i * 2, size - i);
+}
+
+} // namespace sse
+
+namespace avx2 {
+
+// The 256-bit shuffles and packs work within each 128-bit lane, so results are put back in order
+// with a cross-lane permute.
+
+__attribute__((target("avx2"))) inline void encode(char* dest, const unsigned char* src, size_t size) {
+    const __m256i digits = _mm256_setr_epi8(
+        '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'A', 'B', 'C', 'D', 'E', 'F', //
+        '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'A', 'B', 'C', 'D', 'E', 'F');
+    const __m256i mask = _mm256_set1_epi8(0xf);
+    size_t        i    = 0;
+    for (; i + 32 <= size; i += 32) {
+        __m256i in = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+        __m256i hi = _mm256_shuffle_epi8(digits, _mm256_and_si256(_mm256_srli_epi16(in, 4), mask));
+        __m256i lo = _mm256_shuffle_epi8(digits, _mm256_and_si256(in, mask));
+        __m256i a  = _mm256_unpacklo_epi8(hi, lo); // bytes 0-7, 16-23
+        __m256i b  = _mm256_unpackhi_epi8(hi, lo); // bytes 8-15, 24-31
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dest + i * 2), _mm256_permute2x128_si256(a, b, 0x20));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dest + i * 2 + 32), _mm256_permute2x128_si256(a, b, 0x31));
+    }
+    sse::encode(dest + i * 2, src + i, size - i);
+}
+
+__attribute__((target("avx2"))) inline __m256i nibbles(__m256i ch, __m256i& valid) {
+    __m256i lower    = _mm256_or_si256(ch, _mm256_set1_epi8(0x20));
+    __m256i is_digit = _mm256_andnot_si256(_mm256_cmpgt_epi8(ch, _mm256_set1_epi8('9')), _mm256_cmpgt_epi8(ch, _mm256_set1_epi8('0' - 1)));
+    __m256i is_alpha =
+        _mm256_andnot_si256(_mm256_cmpgt_epi8(lower, _mm256_set1_epi8('f')), _mm256_cmpgt_epi8(lower, _mm256_set1_epi8('a' - 1)));
+    valid = _mm256_and_si256(valid, _mm256_or_si256(is_digit, is_alpha));
+    return _mm256_blendv_epi8(_mm256_sub_epi8(lower, _mm256_set1_epi8('a' - 10)), _mm256_sub_epi8(ch, _mm256_set1_epi8('0')), is_digit);
+}
+
+__attribute__((target("avx2"))) inline bool decode(unsigned char* dest, const char* src, size_t size) {
+    const __m256i weights = _mm256_set1_epi16(0x0110);
+    __m256i       valid   = _mm256_set1_epi8(-1);
+    size_t        i       = 0;
+    for (; i + 32 <= size; i += 32) {
+        __m256i a      = nibbles(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i * 2)), valid);
+        __m256i b      = nibbles(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i * 2 + 32)), valid);
+        __m256i packed = _mm256_packus_epi16(_mm256_maddubs_epi16(a, weights), _mm256_maddubs_epi16(b, weights));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dest + i), _mm256_permute4x64_epi64(packed, 0xd8));
+    }
+    return _mm256_movemask_epi8(valid) == -1 && sse::decode(dest + i, src + i * 2, size - i);
+}
+
+} // namespace avx2
+
+#endif // HEX_CODEC_X86
+
+using encode_fn = void (*)(char* dest, const unsigned char* src, size_t size);
+using decode_fn = bool (*)(unsigned char* dest, const char* src, size_t size);
+
+struct implementation {
+    const char* name   = "";
+    encode_fn   encode = nullptr;
+    decode_fn   decode = nullptr;
+};
+
+inline implementation select_implementation() {
+#ifdef HEX_CODEC_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return {"avx2", avx2::encode, avx2::decode};
+    if (__builtin_cpu_supports("sse4.1"))
+        return {"sse4.1", sse::encode, sse::decode};
+#endif
+    return {"scalar", scalar::encode, scalar::decode};
+}
+
+inline const implementation& best() {
+    static const implementation impl = select_implementation();
+    return impl;
+}
+
+// Writes 2 * size characters
+inline void encode(char* dest, const void* src, size_t size) { best().encode(dest, reinterpret_cast<const unsigned char*>(src), size); }
+
+// Reads 2 * size characters. Returns false if any isn't a hex digit.
+inline bool decode(void* dest, const char* src, size_t size) { return best().decode(reinterpret_cast<unsigned char*>(dest), src, size); }
+
+// Appends the encoding of size bytes to dest
+inline void append(std::string& dest, const void* src, size_t size) {
+    auto pos = dest.size();
+    dest.resize(pos + size * 2);
+    encode(dest.data() + pos, src, size);
+}
+
+} // namespace hex_codec
@@ -0,0 +1,120 @@
+// copyright defined in LICENSE.txt
+
+#include "hex_codec.hpp"
+
+#include <boost/test/unit_test.hpp>
+#include <random>
+#include <vector>
+
+namespace {
+
+// Every implementation this CPU can run, scalar first
+std::vector<hex_codec::implementation> implementations() {
+    std::vector<hex_codec::implementation> result{{"scalar", hex_codec::scalar::encode, hex_codec::scalar::decode}};
+#ifdef HEX_CODEC_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.1"))
+        result.push_back({"sse4.1", hex_codec::sse::encode, hex_codec::sse::decode});
+    if (__builtin_cpu_supports("avx2"))
+        result.push_back({"avx2", hex_codec::avx2::encode, hex_codec::avx2::decode});
+#endif
+    return result;
+}
+
+std::vector<unsigned char> random_bytes(std::mt19937& rng, size_t size) {
+    std::vector<unsigned char> result(size);
+    for (auto& b : result)
+        b = rng();
+    return result;
+}
+
+std::string scalar_hex(const std::vector<unsigned char>& bytes) {
+    std::string result(bytes.size() * 2, 0);
+    hex_codec::scalar::encode(result.data(), bytes.data(), bytes.size());
+    return result;
+}
+
+// Every size up to this covers each tail length after the 16- and 32-byte blocks, with and without a
+// whole block before it
+const size_t max_tail_size = 64;
+
+} // namespace
+
+BOOST_AUTO_TEST_SUITE(hex_codec_suite)
+
+BOOST_AUTO_TEST_CASE(scalar_matches_known_values) {
+    std::vector<unsigned char> bytes{0x00, 0x01, 0x7f, 0x80, 0xab, 0xff};
+    BOOST_TEST(scalar_hex(bytes) == "00017F80ABFF");
+    std::vector<unsigned char> decoded(bytes.size());
+    BOOST_TEST(hex_codec::scalar::decode(decoded.data(), "00017f80AbFF", decoded.size()));
+    BOOST_TEST(decoded == bytes);
+}
+
+BOOST_AUTO_TEST_CASE(encode_matches_scalar) {
+    std::mt19937 rng{1};
+    for (auto& impl : implementations()) {
+        BOOST_TEST_CONTEXT(impl.name) {
+            for (size_t size = 0; size <= max_tail_size * 2; ++size) {
+                for (int round = 0; round < 8; ++round) {
+                    auto        bytes = random_bytes(rng, size);
+                    std::string hex(size * 2, 0);
+                    impl.encode(hex.data(), bytes.data(), size);
+                    BOOST_TEST(hex == scalar_hex(bytes), "size " << size);
+                }
+            }
+        }
+    }
+}
+
+// Letters are upper or lower case at random
+BOOST_AUTO_TEST_CASE(decode_matches_scalar_with_mixed_case) {
+    std::mt19937 rng{2};
+    for (auto& impl : implementations()) {
+        BOOST_TEST_CONTEXT(impl.name) {
+            for (size_t size = 0; size <= max_tail_size * 2; ++size) {
+                for (int round = 0; round < 8; ++round) {
+                    auto bytes = random_bytes(rng, size);
+                    auto hex   = scalar_hex(bytes);
+                    for (auto& ch : hex)
+                        if (ch >= 'A' && ch <= 'F' && rng() % 2)
+                            ch += 'a' - 'A';
+                    std::vector<unsigned char> decoded(size);
+                    BOOST_TEST(impl.decode(decoded.data(), hex.data(), size), "size " << size);
+                    BOOST_TEST(decoded == bytes, "size " << size);
+                }
+            }
+        }
+    }
+}
+
+// One bad character anywhere, including each lane of the SIMD blocks and the scalar tail
+BOOST_AUTO_TEST_CASE(decode_rejects_invalid_characters) {
+    static const unsigned char invalid[] = {0x80, 0xb0, 0xc1, 0xe6, 0xff, 0x00, '/', ':', '@', 'G', '`', 'g', ' '};
+    std::mt19937               rng{3};
+    for (auto& impl : implementations()) {
+        BOOST_TEST_CONTEXT(impl.name) {
+            for (size_t size = 1; size <= max_tail_size; ++size) {
+                auto hex = scalar_hex(random_bytes(rng, size));
+                for (size_t pos = 0; pos < hex.size(); ++pos) {
+                    for (auto bad : invalid) {
+                        auto corrupt = hex;
+                        corrupt[pos] = bad;
+                        std::vector<unsigned char> decoded(size);
+                        BOOST_TEST(
+                            !impl.decode(decoded.data(), corrupt.data(), size), "size " << size << " pos " << pos << " byte " << int(bad));
+                    }
+                }
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(best_is_one_of_the_implementations) {
+    auto& best  = hex_codec::best();
+    bool  found = false;
+    for (auto& impl : implementations())
+        found = found || (impl.encode == best.encode && impl.decode == best.decode);
+    BOOST_TEST(found);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
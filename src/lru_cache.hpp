@@ -0,0 +1,103 @@
+// copyright defined in LICENSE.txt
+
+#pragma once
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+// Thread-safe LRU map from byte strings to values, bounded by the approximate number of bytes held.
+// Values are immutable once inserted and shared with readers, so a hit never copies under the lock.
+template <typename T>
+struct lru_cache {
+    static constexpr size_t entry_overhead = 128; // list node, index node, shared_ptr control block
+
+    struct entry {
+        std::string              key   = {};
+        std::shared_ptr<const T> value = {};
+        size_t                   size  = {};
+    };
+
+    using list_type = std::list<entry>;
+
+    const size_t                                                       max_bytes;
+    std::mutex                                                         mutex;
+    list_type                                                          entries; // most recently used first
+    std::unordered_map<std::string_view, typename list_type::iterator> index;   // keys point into entries
+    size_t                                                             bytes     = 0;
+    std::atomic<uint64_t>                                              hits      = 0;
+    std::atomic<uint64_t>                                              misses    = 0;
+    std::atomic<uint64_t>                                              evictions = 0;
+
+    explicit lru_cache(size_t max_bytes)
+        : max_bytes(max_bytes) {}
+
+    // Returns null and drops the entry if valid(value) is false
+    template <typename F>
+    std::shared_ptr<const T> get(std::string_view key, F valid) {
+        std::lock_guard lock{mutex};
+        auto            it = index.find(key);
+        if (it != index.end()) {
+            if (valid(*it->second->value)) {
+                entries.splice(entries.begin(), entries, it->second);
+                ++hits;
+                return it->second->value;
+            }
+            remove(it->second);
+        }
+        ++misses;
+        return nullptr;
+    }
+
+    // size is the value's approximate footprint
+    void put(std::string key, std::shared_ptr<const T> value, size_t size) {
+        size += key.size() + entry_overhead;
+        if (size > max_bytes)
+            return;
+        std::lock_guard lock{mutex};
+        auto            it = index.find(key);
+        if (it != index.end())
+            remove(it->second);
+        entries.push_front(entry{std::move(key), std::move(value), size});
+        index[entries.front().key] = entries.begin();
+        bytes += size;
+        while (bytes > max_bytes) {
+            remove(std::prev(entries.end()));
+            ++evictions;
+        }
+    }
+
+    template <typename F>
+    void erase_if(F f) {
+        std::lock_guard lock{mutex};
+        for (auto it = entries.begin(); it != entries.end();) {
+            auto next = std::next(it);
+            if (f(*it->value)) {
+                remove(it);
+                ++evictions;
+            }
+            it = next;
+        }
+    }
+
+    size_t size() {
+        std::lock_guard lock{mutex};
+        return entries.size();
+    }
+
+    size_t num_bytes() {
+        std::lock_guard lock{mutex};
+        return bytes;
+    }
+
+  private:
+    void remove(typename list_type::iterator it) {
+        bytes -= it->size;
+        index.erase(it->key);
+        entries.erase(it);
+    }
+}; // lru_cache
@@ -0,0 +1,106 @@
+// copyright defined in LICENSE.txt
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+// Counters and histograms which render in the Prometheus text format. Recording only touches
+// atomics, so it's cheap enough for the request path.
+namespace metrics {
+
+using clock = std::chrono::steady_clock;
+
+// Upper bounds, in seconds
+inline constexpr std::array<double, 15> latency_buckets = {
+    0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5,
+};
+
+inline std::string escape_label(const std::string& s) {
+    std::string result;
+    for (auto ch : s) {
+        if (ch == '\\' || ch == '"')
+            result += '\\';
+        if (ch == '\n')
+            result += "\\n";
+        else
+            result += ch;
+    }
+    return result;
+}
+
+inline void write_header(std::string& out, const std::string& name, const char* type, const char* help) {
+    out += "# HELP " + name + " " + help + "\n";
+    out += "# TYPE " + name + " " + type + "\n";
+}
+
+struct histogram {
+    std::array<std::atomic<uint64_t>, latency_buckets.size() + 1> counts = {}; // not cumulative; the last is +Inf
+    std::atomic<uint64_t>                                         sum_ns = 0;
+
+    void observe(clock::duration d) {
+        auto   seconds = std::chrono::duration<double>(d).count();
+        size_t i       = 0;
+        while (i < latency_buckets.size() && seconds > latency_buckets[i])
+            ++i;
+        counts[i].fetch_add(1, std::memory_order_relaxed);
+        sum_ns.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(d).count(), std::memory_order_relaxed);
+    }
+
+    // labels is empty or ends with a comma, e.g. wasm="token",
+    void write(std::string& out, const std::string& name, const std::string& labels) const {
+        uint64_t total = 0;
+        for (size_t i = 0; i < counts.size(); ++i) {
+            total += counts[i].load(std::memory_order_relaxed);
+            auto le = i < latency_buckets.size() ? std::to_string(latency_buckets[i]) : "+Inf";
+            out += name + "_bucket{" + labels + "le=\"" + le + "\"} " + std::to_string(total) + "\n";
+        }
+        auto trimmed = labels.empty() ? labels : "{" + labels.substr(0, labels.size() - 1) + "}";
+        out += name + "_sum" + trimmed + " " + std::to_string(sum_ns.load(std::memory_order_relaxed) / 1e9) + "\n";
+        out += name + "_count" + trimmed + " " + std::to_string(total) + "\n";
+    }
+};
+
+// One histogram per label value, created on first use. Label values must come from a bounded set,
+// e.g. query names from the config.
+struct labeled_histogram {
+    const std::string                                 name;
+    const std::string                                 label;
+    const char* const                                 help;
+    std::mutex                                        mutex;
+    std::map<std::string, std::unique_ptr<histogram>> histograms;
+
+    labeled_histogram(std::string name, std::string label, const char* help)
+        : name(std::move(name))
+        , label(std::move(label))
+        , help(help) {}
+
+    // The result stays valid for the life of this object
+    histogram& get(const std::string& value) {
+        std::lock_guard lock{mutex};
+        auto&           h = histograms[value];
+        if (!h)
+            h = std::make_unique<histogram>();
+        return *h;
+    }
+
+    void write(std::string& out) {
+        write_header(out, name, "histogram", help);
+        std::lock_guard lock{mutex};
+        for (auto& [value, h] : histograms)
+            h->write(out, name, label + "=\"" + escape_label(value) + "\",");
+    }
+};
+
+template <typename T>
+void write_value(std::string& out, const std::string& name, const char* type, const char* help, T value) {
+    write_header(out, name, type, help);
+    out += name + " " + std::to_string(value) + "\n";
+}
+
+} // namespace metrics
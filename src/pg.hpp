@@ -0,0 +1,240 @@
+// copyright defined in LICENSE.txt
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <iterator>
+#include <libpq-fe.h>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <poll.h>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Thin wrapper over libpq. libpqxx can't request binary-format results, so wasm-ql talks to libpq
+// directly.
+namespace pg {
+
+enum class format : int {
+    text   = 0,
+    binary = 1,
+};
+
+struct field {
+    const char* data    = ""; // libpq always null-terminates, even in binary format
+    int         size    = 0;
+    bool        is_null = true;
+
+    std::string_view view() const { return {data, size_t(size)}; }
+};
+
+struct result {
+    std::unique_ptr<PGresult, decltype(&PQclear)> res{nullptr, PQclear};
+
+    int  size() const { return PQntuples(res.get()); }
+    bool empty() const { return !size(); }
+    int  columns() const { return PQnfields(res.get()); }
+
+    field get(int row, int column) const {
+        return field{PQgetvalue(res.get(), row, column), PQgetlength(res.get(), row, column), !!PQgetisnull(res.get(), row, column)};
+    }
+};
+
+struct connection {
+    std::unique_ptr<PGconn, decltype(&PQfinish)> conn{nullptr, PQfinish};
+    std::chrono::steady_clock::time_point        last_used = std::chrono::steady_clock::now();
+
+    // An empty conninfo uses the PG* environment variables, like libpqxx does
+    explicit connection(const std::string& conninfo = "") {
+        conn.reset(PQconnectdb(conninfo.c_str()));
+        if (!conn)
+            throw std::runtime_error("PQconnectdb failed");
+        if (PQstatus(conn.get()) != CONNECTION_OK)
+            throw std::runtime_error(std::string("connecting to database: ") + PQerrorMessage(conn.get()));
+    }
+
+    result check(PGresult* r, const char* what) {
+        result res;
+        res.res.reset(r);
+        if (!r)
+            throw std::runtime_error(std::string(what) + ": " + PQerrorMessage(conn.get()));
+        auto status = PQresultStatus(r);
+        if (status != PGRES_COMMAND_OK && status != PGRES_TUPLES_OK && status != PGRES_SINGLE_TUPLE)
+            throw std::runtime_error(std::string(what) + ": " + PQresultErrorMessage(r));
+        return res;
+    }
+
+    result exec(const std::string& sql, format result_format = format::text) {
+        return check(PQexecParams(conn.get(), sql.c_str(), 0, nullptr, nullptr, nullptr, nullptr, int(result_format)), "exec");
+    }
+
+    // values are text format; nullptr binds sql null
+    result exec_params(const std::string& sql, const std::vector<const char*>& values, format result_format = format::text) {
+        return check(
+            PQexecParams(conn.get(), sql.c_str(), values.size(), nullptr, values.data(), nullptr, nullptr, int(result_format)), "exec");
+    }
+
+    // Runs ;-separated statements through the simple query protocol in one round trip. Returns the
+    // last statement's result, in text format.
+    result exec_script(const std::string& sql) { return check(PQexec(conn.get(), sql.c_str()), "exec"); }
+
+    void prepare(const std::string& name, const std::string& sql) {
+        check(PQprepare(conn.get(), name.c_str(), sql.c_str(), 0, nullptr), ("prepare " + name).c_str());
+    }
+
+    // Waits up to timeout for a notification on a channel this connection LISTENs to. Returns true if
+    // any arrived.
+    bool wait_for_notification(std::chrono::milliseconds timeout) {
+        pollfd pfd{PQsocket(conn.get()), POLLIN, 0};
+        if (pfd.fd < 0)
+            throw std::runtime_error("connection is closed");
+        ::poll(&pfd, 1, timeout.count());
+        if (!PQconsumeInput(conn.get()))
+            throw std::runtime_error(std::string("wait_for_notification: ") + PQerrorMessage(conn.get()));
+        bool found = false;
+        while (auto* n = PQnotifies(conn.get())) {
+            PQfreemem(n);
+            found = true;
+        }
+        return found;
+    }
+
+    // values are text format; nullptr binds sql null
+    result exec_prepared(const std::string& name, const std::vector<const char*>& values, format result_format = format::text) {
+        return check(
+            PQexecPrepared(conn.get(), name.c_str(), values.size(), values.data(), nullptr, nullptr, int(result_format)),
+            name.c_str());
+    }
+};
+
+// Bounded set of connections shared between threads. Connections open lazily, up to max_size;
+// checkout() blocks while all of them are in use, and try_checkout() only takes a ready idle one.
+// A connection returned inside a transaction is rolled back. A broken one is closed, and its slot
+// reconnects on a later checkout. on_connect runs on every new connection, e.g. to prepare
+// statements.
+struct pool {
+    using on_connect_fn = std::function<void(connection&)>;
+
+    static constexpr auto health_check_idle_time = std::chrono::seconds(10);
+
+    struct lease {
+        pool*                       owner = nullptr;
+        std::unique_ptr<connection> conn  = {};
+
+        lease(pool* owner, std::unique_ptr<connection> conn)
+            : owner(owner)
+            , conn(std::move(conn)) {}
+        lease(lease&&) = default;
+        ~lease() {
+            if (conn)
+                owner->release(std::move(conn));
+        }
+
+        connection& operator*() { return *conn; }
+        connection* operator->() { return conn.get(); }
+    };
+
+    const size_t                             max_size;
+    const std::string                        conninfo;
+    const on_connect_fn                      on_connect;
+    std::mutex                               mutex;
+    std::condition_variable                  cv;
+    std::vector<std::unique_ptr<connection>> idle;
+    size_t                                   num_open = 0;
+
+    pool(size_t max_size, std::string conninfo, on_connect_fn on_connect)
+        : max_size(max_size)
+        , conninfo(std::move(conninfo))
+        , on_connect(std::move(on_connect)) {}
+
+    lease checkout() {
+        std::unique_lock lock{mutex};
+        cv.wait(lock, [&] { return !idle.empty() || num_open < max_size; });
+        return take(lock);
+    }
+
+    // Never blocks: only hands out an idle connection which needs neither a reconnect nor a health
+    // check, so there's no I/O. Returns nothing if there isn't one.
+    std::optional<lease> try_checkout() {
+        std::lock_guard lock{mutex};
+        auto            now = std::chrono::steady_clock::now();
+        for (auto it = idle.rbegin(); it != idle.rend(); ++it) {
+            auto& conn = **it;
+            if (PQstatus(conn.conn.get()) == CONNECTION_OK && now - conn.last_used < health_check_idle_time) {
+                auto result = std::move(*it);
+                idle.erase(std::next(it).base());
+                return lease{this, std::move(result)};
+            }
+        }
+        return {};
+    }
+
+  private:
+    lease take(std::unique_lock<std::mutex>& lock) {
+        std::unique_ptr<connection> conn;
+        if (!idle.empty()) {
+            conn = std::move(idle.back());
+            idle.pop_back();
+        } else {
+            ++num_open;
+        }
+        lock.unlock();
+        try {
+            if (conn && !healthy(*conn))
+                conn.reset();
+            if (!conn) {
+                conn = std::make_unique<connection>(conninfo);
+                on_connect(*conn);
+            }
+            return lease{this, std::move(conn)};
+        } catch (...) {
+            lock.lock();
+            --num_open;
+            cv.notify_one();
+            throw;
+        }
+    }
+
+    // A connection which has sat idle may have been dropped by the server or a proxy without
+    // libpq noticing yet
+    static bool healthy(connection& conn) {
+        if (PQstatus(conn.conn.get()) != CONNECTION_OK)
+            return false;
+        if (std::chrono::steady_clock::now() - conn.last_used < health_check_idle_time)
+            return true;
+        try {
+            conn.exec("select 1");
+            return true;
+        } catch (...) {
+            return false;
+        }
+    }
+
+    void release(std::unique_ptr<connection> conn) {
+        auto ts = PQtransactionStatus(conn->conn.get());
+        if (ts == PQTRANS_INTRANS || ts == PQTRANS_INERROR) {
+            try {
+                conn->exec("rollback");
+            } catch (...) {
+            }
+        }
+        bool reuse = PQstatus(conn->conn.get()) == CONNECTION_OK && PQtransactionStatus(conn->conn.get()) == PQTRANS_IDLE;
+        if (reuse)
+            conn->last_used = std::chrono::steady_clock::now();
+        else
+            conn.reset();
+        std::lock_guard lock{mutex};
+        if (reuse)
+            idle.push_back(std::move(conn));
+        else
+            --num_open;
+        cv.notify_one();
+    }
+};
+
+} // namespace pg
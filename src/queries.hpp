@@ -1,8 +1,10 @@
 // copyright defined in LICENSE.txt
 
 #include "abieos_exception.hpp"
+#include "hex_codec.hpp"
+#include "pg.hpp"
 
-#include <pqxx/pqxx>
+#include <optional>
 
 namespace sql_conversion {
 
@@ -20,27 +22,23 @@ inline const std::string sep        = ",";
 inline std::string quote(std::string s) { return "'" + s + "'"; }
 inline std::string quote_bytea(std::string s) { return "'\\x" + s + "'"; }
 
-inline abieos::bytes sql_to_bytes(const char* ch) {
-    abieos::bytes result;
-    if (!ch || ch[0] != '\\' || ch[1] != 'x')
-        return result;
-    std::string error;
-    if (!abieos::unhex(error, ch + 2, ch + strlen(ch), std::back_inserter(result.data)))
-        result.data.clear();
+inline std::string hex_str(const void* data, size_t size) {
+    std::string result;
+    hex_codec::append(result, data, size);
     return result;
 }
 
 inline abieos::checksum256 sql_to_checksum256(const char* ch) {
     if (!*ch)
         return {};
-    std::vector<uint8_t> v;
-    std::string          error;
-    if (!abieos::unhex(error, ch, ch + strlen(ch), std::back_inserter(v)))
-        throw std::runtime_error("expected hex string");
     abieos::checksum256 result;
-    if (v.size() != result.value.size())
+    auto                len = strlen(ch);
+    if (len % 2)
+        throw std::runtime_error("expected hex string");
+    if (len != result.value.size() * 2)
         throw std::runtime_error("hex string has incorrect length");
-    memcpy(result.value.data(), v.data(), result.value.size());
+    if (!hex_codec::decode(result.value.data(), ch, result.value.size()))
+        throw std::runtime_error("expected hex string");
     return result;
 }
 
@@ -63,12 +61,38 @@ inline std::string sql_str(abieos::name v)                  { return quote(v.val
 inline std::string sql_str(abieos::time_point v)            { return v.microseconds ? quote(std::string(v)): null_value; }
 inline std::string sql_str(abieos::time_point_sec v)        { return v.utc_seconds ? quote(std::string(v)): null_value; }
 inline std::string sql_str(abieos::block_timestamp v)       { return v.slot ?  quote(std::string(v)) : null_value; }
-inline std::string sql_str(const abieos::checksum256& v)    { return quote(v.value == abieos::checksum256{}.value ? "" : std::string(v)); }
+inline std::string sql_str(const abieos::checksum256& v)    { return quote(v.value == abieos::checksum256{}.value ? "" : hex_str(v.value.data(), v.value.size())); }
 inline std::string sql_str(const abieos::public_key& v)     { return quote(public_key_to_string(v)); }
 inline std::string sql_str(const abieos::bytes&)            { throw std::runtime_error("sql_str(bytes): not implemented"); }
 inline std::string sql_str(transaction_status)              { throw std::runtime_error("sql_str(transaction_status): not implemented"); }
 // clang-format on
 
+// Text-format parameters for prepared statements. nullopt binds sql null.
+// clang-format off
+inline std::optional<std::string> sql_param(bool v)                       { return v ? "true" : "false";}
+inline std::optional<std::string> sql_param(uint8_t v)                    { return std::to_string(v); }
+inline std::optional<std::string> sql_param(int8_t v)                     { return std::to_string(v); }
+inline std::optional<std::string> sql_param(uint16_t v)                   { return std::to_string(v); }
+inline std::optional<std::string> sql_param(int16_t v)                    { return std::to_string(v); }
+inline std::optional<std::string> sql_param(uint32_t v)                   { return std::to_string(v); }
+inline std::optional<std::string> sql_param(int32_t v)                    { return std::to_string(v); }
+inline std::optional<std::string> sql_param(uint64_t v)                   { return std::to_string(v); }
+inline std::optional<std::string> sql_param(int64_t v)                    { return std::to_string(v); }
+inline std::optional<std::string> sql_param(abieos::varuint32 v)          { return std::string(v); }
+inline std::optional<std::string> sql_param(abieos::varint32 v)           { return std::string(v); }
+inline std::optional<std::string> sql_param(const abieos::int128& v)      { return std::string(v); }
+inline std::optional<std::string> sql_param(const abieos::uint128& v)     { return std::string(v); }
+inline std::optional<std::string> sql_param(const abieos::float128& v)    { return "\\x" + std::string(v); }
+inline std::optional<std::string> sql_param(abieos::name v)               { return v.value ? std::string(v) : ""; }
+inline std::optional<std::string> sql_param(abieos::time_point v)         { if (!v.microseconds) return {}; return std::string(v); }
+inline std::optional<std::string> sql_param(abieos::time_point_sec v)     { if (!v.utc_seconds) return {}; return std::string(v); }
+inline std::optional<std::string> sql_param(abieos::block_timestamp v)    { if (!v.slot) return {}; return std::string(v); }
+inline std::optional<std::string> sql_param(const abieos::checksum256& v) { return v.value == abieos::checksum256{}.value ? "" : hex_str(v.value.data(), v.value.size()); }
+inline std::optional<std::string> sql_param(const abieos::public_key& v)  { return public_key_to_string(v); }
+inline std::optional<std::string> sql_param(const abieos::bytes&)         { throw std::runtime_error("sql_param(bytes): not implemented"); }
+inline std::optional<std::string> sql_param(transaction_status)           { throw std::runtime_error("sql_param(transaction_status): not implemented"); }
+// clang-format on
+
 template <typename T>
 std::string bin_to_sql(abieos::input_buffer& bin) {
     return sql_str(abieos::read_raw<T>(bin));
@@ -79,69 +103,136 @@ inline std::string bin_to_sql<abieos::bytes>(abieos::input_buffer& bin) {
     abieos::input_buffer b;
     bin_to_native(b, bin);
     std::string result;
-    abieos::hex(b.pos, b.end, back_inserter(result));
-    return quote_bytea(result);
+    result.reserve(5 + (b.end - b.pos) * 2);
+    result += "'\\x";
+    hex_codec::append(result, b.pos, b.end - b.pos);
+    result += "'";
+    return result;
+}
+
+template <typename T>
+std::optional<std::string> bin_to_param(abieos::input_buffer& bin) {
+    return sql_param(abieos::read_raw<T>(bin));
+}
+
+template <>
+inline std::optional<std::string> bin_to_param<abieos::bytes>(abieos::input_buffer& bin) {
+    abieos::input_buffer b;
+    bin_to_native(b, bin);
+    std::string result;
+    result.reserve(2 + (b.end - b.pos) * 2);
+    result += "\\x";
+    hex_codec::append(result, b.pos, b.end - b.pos);
+    return result;
+}
+
+// Results arrive in libpq's binary format. Integers are big-endian and their width depends on the
+// column's sql type rather than the abi type, so any integer column is accepted.
+inline int64_t sql_to_int(const pg::field& f) {
+    if (f.is_null)
+        throw std::runtime_error("unexpected null");
+    auto     p = reinterpret_cast<const uint8_t*>(f.data);
+    uint64_t v = 0;
+    for (int i = 0; i < f.size; ++i)
+        v = (v << 8) | p[i];
+    switch (f.size) {
+    case 2: return int16_t(v);
+    case 4: return int32_t(v);
+    case 8: return int64_t(v);
+    default: throw std::runtime_error("expected an integer field");
+    }
 }
 
-inline abieos::time_point sql_to_time_point(std::string s) {
-    if (s.empty())
+// numeric: ndigits, weight, sign, dscale, then ndigits base-10000 digits; digit i has weight (weight - i)
+inline uint64_t sql_numeric_to_uint64(const pg::field& f) {
+    if (f.is_null)
+        throw std::runtime_error("unexpected null");
+    auto p    = reinterpret_cast<const uint8_t*>(f.data);
+    auto word = [&](int i) { return uint16_t((p[i * 2] << 8) | p[i * 2 + 1]); };
+    if (f.size < 8)
+        throw std::runtime_error("expected a numeric field");
+    auto ndigits = word(0);
+    auto weight  = int16_t(word(1));
+    auto sign    = word(2);
+    // 0x4000 is negative; 0xC000 is NaN, which has no digits and would otherwise read as 0
+    if (sign != 0)
+        throw std::runtime_error("numeric is negative or NaN");
+    if (f.size < 8 + 2 * ndigits)
+        throw std::runtime_error("numeric is truncated");
+    uint64_t result = 0;
+    for (int i = 0; i <= weight; ++i) {
+        uint16_t digit = i < ndigits ? word(4 + i) : 0;
+        if (result > (~uint64_t(0) - digit) / 10000)
+            throw std::runtime_error("numeric is out of range");
+        result = result * 10000 + digit;
+    }
+    return result;
+}
+
+// timestamp: microseconds since 2000-01-01
+inline abieos::time_point sql_to_time_point(const pg::field& f) {
+    if (f.is_null)
         return {};
-    std::replace(s.begin(), s.end(), ' ', 'T');
-    return abieos::string_to_time_point(s);
+    return abieos::time_point{uint64_t(sql_to_int(f) + 946'684'800'000'000ll)};
 }
 
-inline abieos::block_timestamp sql_to_block_timestamp(std::string s) {
-    if (s.empty())
+inline abieos::block_timestamp sql_to_block_timestamp(const pg::field& f) {
+    if (f.is_null)
         return {};
-    std::replace(s.begin(), s.end(), ' ', 'T');
-    return abieos::block_timestamp{abieos::string_to_time_point(s)};
+    return abieos::block_timestamp{sql_to_time_point(f)};
 }
 
 template <typename T>
-void sql_to_bin(std::vector<char>& bin, const pqxx::field& f) {
-    abieos::native_to_bin(bin, f.as<T>());
+void sql_to_bin(std::vector<char>& bin, const pg::field& f) {
+    abieos::native_to_bin(bin, T(sql_to_int(f)));
 }
 
 // clang-format off
 template <>
-void sql_to_bin<transaction_status>(std::vector<char>& bin, const pqxx::field& f) {
+void sql_to_bin<transaction_status>(std::vector<char>& bin, const pg::field& f) {
     if (false) {}
-    else if (!strcmp("executed",  f.c_str())) abieos::native_to_bin(bin, (uint8_t)transaction_status::executed);
-    else if (!strcmp("soft_fail", f.c_str())) abieos::native_to_bin(bin, (uint8_t)transaction_status::soft_fail);
-    else if (!strcmp("hard_fail", f.c_str())) abieos::native_to_bin(bin, (uint8_t)transaction_status::hard_fail);
-    else if (!strcmp("delayed",   f.c_str())) abieos::native_to_bin(bin, (uint8_t)transaction_status::delayed);
-    else if (!strcmp("expired",   f.c_str())) abieos::native_to_bin(bin, (uint8_t)transaction_status::expired);
+    else if (!strcmp("executed",  f.data)) abieos::native_to_bin(bin, (uint8_t)transaction_status::executed);
+    else if (!strcmp("soft_fail", f.data)) abieos::native_to_bin(bin, (uint8_t)transaction_status::soft_fail);
+    else if (!strcmp("hard_fail", f.data)) abieos::native_to_bin(bin, (uint8_t)transaction_status::hard_fail);
+    else if (!strcmp("delayed",   f.data)) abieos::native_to_bin(bin, (uint8_t)transaction_status::delayed);
+    else if (!strcmp("expired",   f.data)) abieos::native_to_bin(bin, (uint8_t)transaction_status::expired);
     else
-        throw std::runtime_error("invalid value for transaction_status: " + f.as<std::string>());
+        throw std::runtime_error("invalid value for transaction_status: " + std::string(f.view()));
 }
 // clang-format on
 
+template <>
+inline void sql_to_bin<abieos::bytes>(std::vector<char>& bin, const pg::field& f) {
+    abieos::push_varuint32(bin, f.size);
+    bin.insert(bin.end(), f.data, f.data + f.size);
+}
+
 // clang-format off
-template <> void sql_to_bin<uint8_t>                    (std::vector<char>& bin, const pqxx::field& f) { abieos::native_to_bin(bin, (uint8_t)f.as<uint16_t>()); }
-template <> void sql_to_bin<int8_t>                     (std::vector<char>& bin, const pqxx::field& f) { abieos::native_to_bin(bin, (int8_t)f.as<int16_t>()); }
-template <> void sql_to_bin<abieos::varuint32>          (std::vector<char>& bin, const pqxx::field& f) { abieos::push_varuint32(bin, f.as<uint32_t>()); }
-template <> void sql_to_bin<abieos::varint32>           (std::vector<char>& bin, const pqxx::field& f) { abieos::push_varint32(bin, f.as<int32_t>()); }
-template <> void sql_to_bin<abieos::int128>             (std::vector<char>& bin, const pqxx::field& f) { throw std::runtime_error("sql_to_bin<abieos::int128> not implemented"); }
-template <> void sql_to_bin<abieos::uint128>            (std::vector<char>& bin, const pqxx::field& f) { throw std::runtime_error("sql_to_bin<abieos::uint128> not implemented"); }
-template <> void sql_to_bin<abieos::float128>           (std::vector<char>& bin, const pqxx::field& f) { throw std::runtime_error("sql_to_bin<abieos::float128> not implemented"); }
-template <> void sql_to_bin<abieos::name>               (std::vector<char>& bin, const pqxx::field& f) { abieos::native_to_bin(bin, abieos::name{f.c_str()}); }
-template <> void sql_to_bin<abieos::time_point>         (std::vector<char>& bin, const pqxx::field& f) { abieos::native_to_bin(bin, sql_to_time_point(f.c_str())); }
-template <> void sql_to_bin<abieos::time_point_sec>     (std::vector<char>& bin, const pqxx::field& f) { throw std::runtime_error("sql_to_bin<abieos::time_point_sec> not implemented"); }
-template <> void sql_to_bin<abieos::block_timestamp>    (std::vector<char>& bin, const pqxx::field& f) { abieos::native_to_bin(bin, sql_to_block_timestamp(f.c_str())); }
-template <> void sql_to_bin<abieos::checksum256>        (std::vector<char>& bin, const pqxx::field& f) { abieos::native_to_bin(bin, sql_to_checksum256(f.c_str())); }
-template <> void sql_to_bin<abieos::public_key>         (std::vector<char>& bin, const pqxx::field& f) { throw std::runtime_error("sql_to_bin<abieos::public_key> not implemented"); }
-template <> void sql_to_bin<abieos::bytes>              (std::vector<char>& bin, const pqxx::field& f) { abieos::native_to_bin(bin, sql_to_bytes(f.c_str())); }
+template <> void sql_to_bin<bool>                       (std::vector<char>& bin, const pg::field& f) { abieos::native_to_bin(bin, bool(f.size == 1 && f.data[0])); }
+template <> void sql_to_bin<uint64_t>                   (std::vector<char>& bin, const pg::field& f) { abieos::native_to_bin(bin, sql_numeric_to_uint64(f)); }
+template <> void sql_to_bin<abieos::varuint32>          (std::vector<char>& bin, const pg::field& f) { abieos::push_varuint32(bin, sql_to_int(f)); }
+template <> void sql_to_bin<abieos::varint32>           (std::vector<char>& bin, const pg::field& f) { abieos::push_varint32(bin, sql_to_int(f)); }
+template <> void sql_to_bin<abieos::int128>             (std::vector<char>& bin, const pg::field& f) { throw std::runtime_error("sql_to_bin<abieos::int128> not implemented"); }
+template <> void sql_to_bin<abieos::uint128>            (std::vector<char>& bin, const pg::field& f) { throw std::runtime_error("sql_to_bin<abieos::uint128> not implemented"); }
+template <> void sql_to_bin<abieos::float128>           (std::vector<char>& bin, const pg::field& f) { throw std::runtime_error("sql_to_bin<abieos::float128> not implemented"); }
+template <> void sql_to_bin<abieos::name>               (std::vector<char>& bin, const pg::field& f) { abieos::native_to_bin(bin, abieos::name{f.data}); }
+template <> void sql_to_bin<abieos::time_point>         (std::vector<char>& bin, const pg::field& f) { abieos::native_to_bin(bin, sql_to_time_point(f)); }
+template <> void sql_to_bin<abieos::time_point_sec>     (std::vector<char>& bin, const pg::field& f) { throw std::runtime_error("sql_to_bin<abieos::time_point_sec> not implemented"); }
+template <> void sql_to_bin<abieos::block_timestamp>    (std::vector<char>& bin, const pg::field& f) { abieos::native_to_bin(bin, sql_to_block_timestamp(f)); }
+template <> void sql_to_bin<abieos::checksum256>        (std::vector<char>& bin, const pg::field& f) { abieos::native_to_bin(bin, sql_to_checksum256(f.data)); }
+template <> void sql_to_bin<abieos::public_key>         (std::vector<char>& bin, const pg::field& f) { throw std::runtime_error("sql_to_bin<abieos::public_key> not implemented"); }
 // clang-format on
 
 struct sql_type {
-    const char* type                                               = "";
-    std::string (*bin_to_sql)(abieos::input_buffer&)               = nullptr;
-    void (*sql_to_bin)(std::vector<char>& bin, const pqxx::field&) = nullptr;
+    const char* type                                                  = "";
+    std::string (*bin_to_sql)(abieos::input_buffer&)                  = nullptr;
+    std::optional<std::string> (*bin_to_param)(abieos::input_buffer&) = nullptr;
+    void (*sql_to_bin)(std::vector<char>& bin, const pg::field&)      = nullptr;
 };
 
 template <typename T>
 constexpr sql_type make_sql_type_for(const char* name) {
-    return sql_type{name, bin_to_sql<T>, sql_to_bin<T>};
+    return sql_type{name, bin_to_sql<T>, bin_to_param<T>, sql_to_bin<T>};
 }
 
 template <typename T>
@@ -266,6 +357,7 @@ struct query {
     std::vector<sql_type> result_types = {};
     table*                result_table = {};
     table*                join_table   = {};
+    uint32_t              num_params   = {};
 };
 
 template <typename F>
@@ -333,6 +425,7 @@ struct config {
                 }
             };
             add_types(query.range_types, query.sort_keys, query.result_table);
+            query.num_params = query.limit_block_index + query.arg_types.size() + 2 * query.range_types.size() + 1;
 
             query.result_types = query.result_table->types;
             if (!query.join.empty()) {
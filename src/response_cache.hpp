@@ -0,0 +1,41 @@
+// copyright defined in LICENSE.txt
+
+#pragma once
+
+#include "abieos.hpp"
+#include "lru_cache.hpp"
+#include <vector>
+
+// A whole reply, keyed by the request bytes (plus the target for legacy endpoints).
+//
+// The key doesn't include a block number. While a request runs, the server notes whether anything it
+// read could change as head moves: reading get_context_data (head- or irreversible-relative block
+// selections), or a query whose max_block is past the irreversible block or which has no block
+// limit. If so, the reply is tagged with the head_id it saw and is only valid while head_id stays the
+// same. Anything else only read irreversible blocks, which can't change, so it stays valid until
+// evicted. Keying every entry on the irreversible block instead would miss on every new block even
+// for data which can't change.
+//
+// A fork replaces head_id even if head's block number doesn't change, so it invalidates every
+// head-dependent reply. Irreversible blocks are never forked out, so the other replies survive it.
+//
+// Replies are also tagged with module_cache's generation, since a reload may change what a wasm
+// returns for the same request.
+struct cached_response {
+    std::vector<char>   body            = {};
+    bool                depends_on_head = {};
+    abieos::checksum256 head_id         = {};
+    uint32_t            generation      = {}; // module_cache's when the request started
+
+    // Whether this may be served while head is current_head_id and module_cache is at current_generation
+    bool valid(const abieos::checksum256& current_head_id, uint32_t current_generation) const {
+        return generation == current_generation && !stale(current_head_id);
+    }
+
+    // Whether head moving to current_head_id invalidates this
+    bool stale(const abieos::checksum256& current_head_id) const {
+        return depends_on_head && head_id.value != current_head_id.value;
+    }
+};
+
+using response_cache = lru_cache<cached_response>;
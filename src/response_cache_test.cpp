@@ -0,0 +1,68 @@
+// copyright defined in LICENSE.txt
+
+#include "response_cache.hpp"
+
+#include <boost/test/unit_test.hpp>
+
+namespace {
+
+abieos::checksum256 block_id(uint8_t n) {
+    abieos::checksum256 result;
+    result.value[0] = n;
+    return result;
+}
+
+std::shared_ptr<const cached_response> response(bool depends_on_head, const abieos::checksum256& head_id, uint32_t generation) {
+    auto r             = std::make_shared<cached_response>();
+    r->body            = {'o', 'k'};
+    r->depends_on_head = depends_on_head;
+    r->head_id         = head_id;
+    r->generation      = generation;
+    return r;
+}
+
+// What the fill_status listener does when head changes
+void advance_head(response_cache& cache, const abieos::checksum256& head_id) {
+    cache.erase_if([&](const cached_response& r) { return r.stale(head_id); });
+}
+
+std::shared_ptr<const cached_response> find(response_cache& cache, const std::string& key, const abieos::checksum256& head_id) {
+    return cache.get(key, [&](const cached_response& r) { return r.valid(head_id, 0); });
+}
+
+} // namespace
+
+BOOST_AUTO_TEST_SUITE(response_cache_suite)
+
+// A request which only selected absolute blocks at or below irreversible never reads the context,
+// so its reply isn't tied to head
+BOOST_AUTO_TEST_CASE(absolute_block_reply_survives_head_advance) {
+    response_cache cache{1024 * 1024};
+    cache.put("absolute", response(false, block_id(1), 0), 2);
+    cache.put("head", response(true, block_id(1), 0), 2);
+
+    advance_head(cache, block_id(2));
+    BOOST_TEST(find(cache, "absolute", block_id(2)));
+    BOOST_TEST(!find(cache, "head", block_id(2)));
+    BOOST_TEST(cache.size() == 1u);
+}
+
+// A fork changes head_id without necessarily changing head's block number
+BOOST_AUTO_TEST_CASE(fork_drops_head_dependent_replies) {
+    response_cache cache{1024 * 1024};
+    cache.put("absolute", response(false, block_id(1), 0), 2);
+    cache.put("head", response(true, block_id(1), 0), 2);
+
+    BOOST_TEST(find(cache, "head", block_id(1)));
+    BOOST_TEST(!find(cache, "head", block_id(3)));
+    BOOST_TEST(find(cache, "absolute", block_id(3)));
+}
+
+// Replies from before a reload may have come from the old wasm
+BOOST_AUTO_TEST_CASE(reload_drops_replies_from_older_generation) {
+    auto r = response(false, block_id(1), 0);
+    BOOST_TEST(r->valid(block_id(1), 0));
+    BOOST_TEST(!r->valid(block_id(1), 1));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,207 @@
+// copyright defined in LICENSE.txt
+
+// Microbenchmarks for the per-field conversions in queries.hpp. Build with -DWASM_QL_BENCHMARKS=ON;
+// the run-benchmarks target writes the results to sql_conversion_bench.json in the build directory.
+
+#include "queries.hpp"
+
+#include <benchmark/benchmark.h>
+
+using namespace sql_conversion;
+
+namespace {
+
+// libpq's binary format: big-endian integers, raw bytea, text for varchar. Field data is always
+// null-terminated.
+struct sql_value {
+    std::string data;
+
+    pg::field field() const { return pg::field{data.c_str(), int(data.size()), false}; }
+};
+
+sql_value big_endian(uint64_t v, int size) {
+    sql_value result;
+    for (int i = size - 1; i >= 0; --i)
+        result.data.push_back(char(v >> (i * 8)));
+    return result;
+}
+
+// numeric with one base-10000 digit per 4 decimal digits
+sql_value numeric(uint64_t v) {
+    std::vector<uint16_t> digits;
+    for (; v; v /= 10000)
+        digits.insert(digits.begin(), uint16_t(v % 10000));
+    auto result = big_endian(digits.size(), 2).data + big_endian(digits.size() - 1, 2).data + big_endian(0, 2).data + big_endian(0, 2).data;
+    for (auto d : digits)
+        result += big_endian(d, 2).data;
+    return {result};
+}
+
+sql_value bytea(size_t size) {
+    sql_value result;
+    for (size_t i = 0; i < size; ++i)
+        result.data.push_back(char(i * 131 + 7));
+    return result;
+}
+
+const sql_value checksum_hex = {"3f1d1c1c7f1bf8b1e31f2b6e5cbd93a2bb4a4acb0f7ab29d8cd4e02e3c2b4d11"};
+const sql_value name_text    = {"eosio.token"};
+const sql_value timestamp    = big_endian(582'336'000'000'000ll, 8); // 2018-06-15, microseconds since 2000
+const sql_value block_index  = big_endian(31'415'926, 8);
+const sql_value global_seq   = numeric(12'345'678'901ull);
+const sql_value status_text  = {"executed"};
+
+template <typename T>
+std::vector<char> to_bin(const T& v) {
+    std::vector<char> bin;
+    abieos::native_to_bin(bin, v);
+    return bin;
+}
+
+template <typename T>
+void bm_sql_to_bin(benchmark::State& state, const sql_value& value) {
+    auto              f = value.field();
+    std::vector<char> bin;
+    for (auto _ : state) {
+        bin.clear();
+        sql_to_bin<T>(bin, f);
+        benchmark::DoNotOptimize(bin);
+    }
+    state.SetBytesProcessed(state.iterations() * value.data.size());
+}
+
+template <typename T>
+void bm_bin_to_sql(benchmark::State& state, const std::vector<char>& bin) {
+    for (auto _ : state) {
+        abieos::input_buffer b{bin.data(), bin.data() + bin.size()};
+        auto                 result = bin_to_sql<T>(b);
+        benchmark::DoNotOptimize(result);
+    }
+    state.SetBytesProcessed(state.iterations() * bin.size());
+}
+
+template <typename T>
+void bm_bin_to_param(benchmark::State& state, const std::vector<char>& bin) {
+    for (auto _ : state) {
+        abieos::input_buffer b{bin.data(), bin.data() + bin.size()};
+        auto                 result = bin_to_param<T>(b);
+        benchmark::DoNotOptimize(result);
+    }
+    state.SetBytesProcessed(state.iterations() * bin.size());
+}
+
+void bm_sql_to_checksum256(benchmark::State& state) {
+    for (auto _ : state) {
+        auto result = sql_to_checksum256(checksum_hex.data.c_str());
+        benchmark::DoNotOptimize(result);
+    }
+    state.SetBytesProcessed(state.iterations() * checksum_hex.data.size());
+}
+
+void bm_sql_to_time_point(benchmark::State& state) {
+    auto f = timestamp.field();
+    for (auto _ : state) {
+        auto result = sql_to_time_point(f);
+        benchmark::DoNotOptimize(result);
+    }
+}
+
+void bm_sql_str_checksum256(benchmark::State& state) {
+    auto v = sql_to_checksum256(checksum_hex.data.c_str());
+    for (auto _ : state) {
+        auto result = sql_str(v);
+        benchmark::DoNotOptimize(result);
+    }
+}
+
+void bm_sql_str_name(benchmark::State& state) {
+    abieos::name v{name_text.data.c_str()};
+    for (auto _ : state) {
+        auto result = sql_str(v);
+        benchmark::DoNotOptimize(result);
+    }
+}
+
+void bm_sql_str_time_point(benchmark::State& state) {
+    auto v = sql_to_time_point(timestamp.field());
+    for (auto _ : state) {
+        auto result = sql_str(v);
+        benchmark::DoNotOptimize(result);
+    }
+}
+
+void bm_sql_to_bin_bytes(benchmark::State& state) { bm_sql_to_bin<abieos::bytes>(state, bytea(state.range(0))); }
+
+void bm_bin_to_sql_bytes(benchmark::State& state) {
+    std::vector<char> bin;
+    sql_to_bin<abieos::bytes>(bin, bytea(state.range(0)).field());
+    bm_bin_to_sql<abieos::bytes>(state, bin);
+}
+
+void bm_bin_to_param_bytes(benchmark::State& state) {
+    std::vector<char> bin;
+    sql_to_bin<abieos::bytes>(bin, bytea(state.range(0)).field());
+    bm_bin_to_param<abieos::bytes>(state, bin);
+}
+
+// hex_codec picks the widest implementation the CPU has; the label says which one ran
+void bm_hex_encode(benchmark::State& state, hex_codec::implementation impl) {
+    auto        src = bytea(state.range(0));
+    std::string dest(src.data.size() * 2, 0);
+    for (auto _ : state) {
+        impl.encode(dest.data(), reinterpret_cast<const unsigned char*>(src.data.data()), src.data.size());
+        benchmark::DoNotOptimize(dest);
+    }
+    state.SetLabel(impl.name);
+    state.SetBytesProcessed(state.iterations() * src.data.size());
+}
+
+void bm_hex_decode(benchmark::State& state, hex_codec::implementation impl) {
+    auto        src = bytea(state.range(0));
+    std::string hex(src.data.size() * 2, 0);
+    hex_codec::encode(hex.data(), src.data.data(), src.data.size());
+    std::vector<unsigned char> dest(src.data.size());
+    for (auto _ : state) {
+        bool ok = impl.decode(dest.data(), hex.data(), dest.size());
+        benchmark::DoNotOptimize(ok);
+        benchmark::DoNotOptimize(dest);
+    }
+    state.SetLabel(impl.name);
+    state.SetBytesProcessed(state.iterations() * src.data.size());
+}
+
+const hex_codec::implementation scalar_hex = {"scalar", hex_codec::scalar::encode, hex_codec::scalar::decode};
+
+} // namespace
+
+// sql -> bin, which exec_query runs for every field of every row
+BENCHMARK_CAPTURE(bm_sql_to_bin<abieos::checksum256>, checksum256, checksum_hex);
+BENCHMARK_CAPTURE(bm_sql_to_bin<abieos::name>, name, name_text);
+BENCHMARK_CAPTURE(bm_sql_to_bin<abieos::time_point>, time_point, timestamp);
+BENCHMARK_CAPTURE(bm_sql_to_bin<abieos::block_timestamp>, block_timestamp, timestamp);
+BENCHMARK_CAPTURE(bm_sql_to_bin<uint32_t>, uint32, block_index);
+BENCHMARK_CAPTURE(bm_sql_to_bin<uint64_t>, uint64_numeric, global_seq);
+BENCHMARK_CAPTURE(bm_sql_to_bin<transaction_status>, transaction_status, status_text);
+BENCHMARK(bm_sql_to_bin_bytes)->RangeMultiplier(16)->Range(16, 1 << 20);
+BENCHMARK(bm_sql_to_checksum256);
+BENCHMARK(bm_sql_to_time_point);
+
+// bin -> sql, which builds the query arguments
+BENCHMARK_CAPTURE(bm_bin_to_sql<abieos::checksum256>, checksum256, to_bin(sql_to_checksum256(checksum_hex.data.c_str())));
+BENCHMARK_CAPTURE(bm_bin_to_sql<abieos::name>, name, to_bin(abieos::name{name_text.data.c_str()}));
+BENCHMARK_CAPTURE(bm_bin_to_sql<abieos::time_point>, time_point, to_bin(sql_to_time_point(timestamp.field())));
+BENCHMARK_CAPTURE(bm_bin_to_param<abieos::checksum256>, checksum256, to_bin(sql_to_checksum256(checksum_hex.data.c_str())));
+BENCHMARK_CAPTURE(bm_bin_to_param<abieos::name>, name, to_bin(abieos::name{name_text.data.c_str()}));
+BENCHMARK(bm_bin_to_sql_bytes)->RangeMultiplier(16)->Range(16, 1 << 20);
+BENCHMARK(bm_bin_to_param_bytes)->RangeMultiplier(16)->Range(16, 1 << 20);
+BENCHMARK(bm_sql_str_checksum256);
+BENCHMARK(bm_sql_str_name);
+BENCHMARK(bm_sql_str_time_point);
+
+// hex on its own, for checksums (32 bytes) up to large code and abi blobs
+BENCHMARK_CAPTURE(bm_hex_encode, scalar, scalar_hex)->RangeMultiplier(32)->Range(32, 1 << 20);
+BENCHMARK_CAPTURE(bm_hex_encode, best, hex_codec::best())->RangeMultiplier(32)->Range(32, 1 << 20);
+BENCHMARK_CAPTURE(bm_hex_decode, scalar, scalar_hex)->RangeMultiplier(32)->Range(32, 1 << 20);
+BENCHMARK_CAPTURE(bm_hex_decode, best, hex_codec::best())->RangeMultiplier(32)->Range(32, 1 << 20);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,140 @@
+// copyright defined in LICENSE.txt
+
+#pragma once
+
+#include <chrono>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Per-request spans in the Chrome trace event format, which chrome://tracing and Perfetto load.
+// Each request gets its own track (tid), and nesting shows through the spans' times.
+namespace tracing {
+
+using clock = std::chrono::steady_clock;
+
+inline std::string json_escape(const std::string& s) {
+    std::string result;
+    for (unsigned char ch : s) {
+        if (ch == '"' || ch == '\\') {
+            result += '\\';
+            result += ch;
+        } else if (ch < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", ch);
+            result += buf;
+        } else {
+            result += ch;
+        }
+    }
+    return result;
+}
+
+struct span {
+    std::string       name  = {};
+    const char*       cat   = "";
+    clock::time_point start = {};
+    clock::time_point end   = {};
+    std::string       args  = {}; // members of a json object, e.g. "query":"cr.ctsp"
+};
+
+struct trace {
+    uint64_t          id    = {};
+    std::vector<span> spans = {};
+
+    void add(std::string name, const char* cat, clock::time_point start, clock::time_point end, std::string args = {}) {
+        spans.push_back(span{std::move(name), cat, start, end, std::move(args)});
+    }
+
+    // Starts a span which end() finishes. Returns its index.
+    size_t begin(std::string name, const char* cat, std::string args = {}) {
+        auto now = clock::now();
+        add(std::move(name), cat, now, now, std::move(args));
+        return spans.size() - 1;
+    }
+
+    void end(size_t index) { spans[index].end = clock::now(); }
+
+    // Appends one complete ("X") event per span, each followed by ",\n"
+    void to_json(std::string& out, clock::time_point epoch) const {
+        auto us = [&](clock::duration d) { return std::to_string(std::chrono::duration_cast<std::chrono::microseconds>(d).count()); };
+        for (auto& s : spans) {
+            out += "{\"name\":\"" + json_escape(s.name) + "\",\"cat\":\"" + s.cat + "\",\"ph\":\"X\",\"ts\":" + us(s.start - epoch) +
+                   ",\"dur\":" + us(s.end - s.start) + ",\"pid\":1,\"tid\":" + std::to_string(id);
+            if (!s.args.empty())
+                out += ",\"args\":{" + s.args + "}";
+            out += "},\n";
+        }
+    }
+};
+
+// Covers its own lifetime. Does nothing without a trace.
+struct scoped_span {
+    trace* t     = nullptr;
+    size_t index = 0;
+
+    scoped_span(trace* t, std::string name, const char* cat, std::string args = {})
+        : t(t) {
+        if (t)
+            index = t->begin(std::move(name), cat, std::move(args));
+    }
+
+    ~scoped_span() {
+        if (t)
+            t->end(index);
+    }
+};
+
+// Where finished traces go: appended to a file, kept in memory, or both. The file is a json array
+// which is never closed, which the trace viewers accept.
+struct sink {
+    const size_t            max_recent;
+    const clock::time_point epoch = clock::now();
+    std::mutex              mutex;
+    std::ofstream           file;
+    std::deque<std::string> recent; // each holds one trace's events
+
+    sink(const std::string& filename, size_t max_recent)
+        : max_recent(max_recent) {
+        if (filename.empty())
+            return;
+        file.open(filename, std::ios_base::out | std::ios_base::trunc);
+        if (!file)
+            throw std::runtime_error("can not open " + filename);
+        file << "[\n";
+        file.flush();
+    }
+
+    void write(const trace& t) {
+        std::string events;
+        t.to_json(events, epoch);
+        std::lock_guard lock{mutex};
+        if (file.is_open()) {
+            file << events;
+            file.flush();
+        }
+        if (max_recent) {
+            recent.push_back(std::move(events));
+            while (recent.size() > max_recent)
+                recent.pop_front();
+        }
+    }
+
+    // A complete json array holding the kept traces
+    std::string recent_json() {
+        std::string     result = "[\n";
+        std::lock_guard lock{mutex};
+        for (auto& events : recent)
+            result += events;
+        if (result.size() > 2)
+            result.resize(result.size() - 2); // the last ",\n"
+        result += "\n]\n";
+        return result;
+    }
+};
+
+} // namespace tracing
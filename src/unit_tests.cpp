@@ -0,0 +1,7 @@
+// copyright defined in LICENSE.txt
+
+// Entry point for the unit tests; each *_test.cpp adds its own suite. Run them with ctest or
+// ./unit_tests in the build directory.
+
+#define BOOST_TEST_MODULE wasm_ql
+#include <boost/test/included/unit_test.hpp>
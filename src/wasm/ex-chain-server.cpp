@@ -10,7 +10,7 @@ extern "C" void eosio_assert(uint32_t test, const char* msg) {
         eosio_assert_message(test, msg, strlen(msg));
 }
 
-void process(block_info_request& req, const context_data& context) {
+void process(block_info_request& req, lazy_context_data& context) {
     print("    block_info_request\n");
     auto s = exec_query(query_block_info_range_index{
         .first       = get_block_num(req.first, context),
@@ -28,7 +28,7 @@ void process(block_info_request& req, const context_data& context) {
     print("\n");
 }
 
-void process(tapos_request& req, const context_data& context) {
+void process(tapos_request& req, lazy_context_data& context) {
     print("    tapos_request\n");
     auto s = exec_query(query_block_info_range_index{
         .first       = get_block_num(req.ref_block, context),
@@ -50,7 +50,7 @@ void process(tapos_request& req, const context_data& context) {
     print("\n");
 }
 
-void process(account_request& req, const context_data& context) {
+void process(account_request& req, lazy_context_data& context) {
     print("    account\n");
     auto s = exec_query(query_account_range_name{
         .max_block   = get_block_num(req.max_block, context),
@@ -75,7 +75,7 @@ void process(account_request& req, const context_data& context) {
     print("\n");
 }
 
-void process(abis_request& req, const context_data& context) {
+void process(abis_request& req, lazy_context_data& context) {
     print("    abis\n");
     abis_response response;
     for (auto name : req.names) {
@@ -103,5 +103,6 @@ void process(abis_request& req, const context_data& context) {
 extern "C" void startup() {
     auto request = unpack<chain_request>(get_input_data());
     print("request: ", chain_request::keys[request.value.index()], "\n");
-    std::visit([](auto& x) { process(x, get_context_data()); }, request.value);
+    lazy_context_data context;
+    std::visit([&](auto& x) { process(x, context); }, request.value);
 }
@@ -19,56 +19,23 @@ extern "C" void eosio_assert(uint32_t test, const char* msg) {
         eosio_assert_message(test, msg, strlen(msg));
 }
 
-eosio::datastream<const char*> get_raw_abi(eosio::name name, uint32_t max_block) {
-    eosio::datastream<const char*> result = {nullptr, 0};
-    auto                           s      = exec_query(query_account_range_name{
+// Returns a handle to the ABI, parsed and cached by the host, or 0 if there isn't a valid one
+uint32_t get_abi(eosio::name name, uint32_t max_block) {
+    uint32_t result = 0;
+    auto     s      = exec_query(query_account_range_name{
         .max_block   = max_block,
         .first       = name,
         .last        = name,
         .max_results = 1,
     });
     for_each_query_result<account>(s, [&](account& a) {
-        if (a.present)
-            result = a.abi;
+        if (a.present && a.abi.remaining())
+            result = abi_prepare(a.name, a.block_index, a.abi.pos(), a.abi.remaining());
         return true;
     });
     return result;
 }
 
-struct abi {
-    abieos::abi_def  def{};
-    abieos::contract contract{};
-};
-
-std::unique_ptr<abi> get_abi(eosio::name name, uint32_t max_block) {
-    auto result = std::make_unique<abi>();
-    auto raw    = get_raw_abi(name, max_block);
-    if (!raw.remaining())
-        return {};
-    std::string error;
-    if (!abieos::check_abi_version(abieos::input_buffer{raw.pos(), raw.pos() + raw.remaining()}, error))
-        return {};
-    abieos::input_buffer buf{raw.pos(), raw.pos() + raw.remaining()};
-    if (!abieos::bin_to_native(result->def, error, buf))
-        return {};
-    if (!fill_contract(result->contract, error, result->def))
-        return {};
-    return result;
-}
-
-abieos::abi_type* get_table_type(::abi* abi, abieos::name table) {
-    if (!abi)
-        return nullptr;
-    for (auto& table_def : abi->def.tables) {
-        if (table_def.name == table) {
-            auto it = abi->contract.abi_types.find(table_def.type);
-            if (it != abi->contract.abi_types.end())
-                return &it->second;
-        }
-    }
-    return nullptr;
-}
-
 struct get_table_rows_params {
     bool             json  = false;
     name             code  = {};
@@ -189,7 +156,7 @@ eosio::name get_table_index_name(const get_table_rows_params& p, bool& primary)
 } // get_table_index_name
 
 void get_table_rows_primary(
-    const get_table_rows_params& params, const context_data& context, uint64_t scope, abieos::abi_type* table_type) {
+    const get_table_rows_params& params, const context_data& context, uint64_t scope, uint32_t abi) {
 
     auto lower_bound = convert_key(params.key_type, params.lower_bound, (uint64_t)0);
     auto upper_bound = convert_key(params.key_type, params.upper_bound, (uint64_t)0xffff'ffff'ffff'ffff);
@@ -213,23 +180,23 @@ void get_table_rows_primary(
         .max_results = std::min((uint32_t)100, params.limit),
     });
 
-    // todo: rope
-    std::string result = "{\"rows\":[";
-    bool        found  = false;
+    // rows go out as they are produced; the server may flush them before the query finishes
+    append_output_data("{\"rows\":["sv);
+    std::string result;
+    bool        found = false;
     for_each_query_result<contract_row>(s, [&](contract_row& r) {
         if (!r.present)
             return true;
+        result.clear();
         if (found)
             result += ',';
         found = true;
         if (params.show_payer)
             result += "{\"data\":";
         bool decoded = false;
-        if (table_type) {
-            abieos::input_buffer bin{r.value.pos(), r.value.pos() + r.value.remaining()};
-            std::string          error;
-            std::string          json_row;
-            if (bin_to_json(bin, error, table_type, json_row)) {
+        if (abi) {
+            std::string json_row;
+            if (abi_table_to_json(abi, params.table, r.value.pos(), r.value.remaining(), json_row)) {
                 result += json_row;
                 decoded = true;
             }
@@ -241,15 +208,15 @@ void get_table_rows_primary(
         }
         if (params.show_payer)
             result += ",\"payer\":\"" + r.payer.to_string() + "\"}";
+        append_output_data(result);
         return true;
     });
-    result += "]}";
-    set_output_data(result);
+    append_output_data("]}"sv);
 } // get_table_rows_primary
 
 template <typename T>
 void get_table_rows_secondary(
-    const get_table_rows_params& params, const context_data& context, uint64_t scope, abieos::abi_type* table_type) {
+    const get_table_rows_params& params, const context_data& context, uint64_t scope, uint32_t abi) {
 
     auto lower_bound = convert_key(params.key_type, params.lower_bound, (T)0);
     auto upper_bound = convert_key(params.key_type, params.upper_bound, (T)0xffff'ffff'ffff'ffff);
@@ -275,23 +242,23 @@ void get_table_rows_secondary(
         .max_results = std::min((uint32_t)100, params.limit),
     });
 
-    // todo: rope
-    std::string result = "{\"rows\":[";
-    bool        found  = false;
+    // rows go out as they are produced; the server may flush them before the query finishes
+    append_output_data("{\"rows\":["sv);
+    std::string result;
+    bool        found = false;
     for_each_query_result<contract_secondary_index_with_row<T>>(s, [&](contract_secondary_index_with_row<T>& r) {
         if (!r.present || !r.row_present)
             return true;
+        result.clear();
         if (found)
             result += ',';
         found = true;
         if (params.show_payer)
             result += "{\"data\":";
         bool decoded = false;
-        if (table_type) {
-            abieos::input_buffer bin{r.row_value.pos(), r.row_value.pos() + r.row_value.remaining()};
-            std::string          error;
-            std::string          json_row;
-            if (bin_to_json(bin, error, table_type, json_row)) {
+        if (abi) {
+            std::string json_row;
+            if (abi_table_to_json(abi, params.table, r.row_value.pos(), r.row_value.remaining(), json_row)) {
                 result += json_row;
                 decoded = true;
             }
@@ -303,25 +270,24 @@ void get_table_rows_secondary(
         }
         if (params.show_payer)
             result += ",\"payer\":\"" + r.payer.to_string() + "\"}";
+        append_output_data(result);
         return true;
     });
-    result += "]}";
-    set_output_data(result);
+    append_output_data("]}"sv);
 } // get_table_rows_secondary
 
 // todo: more
 void get_table_rows(std::string_view request, const context_data& context) {
-    auto                   params           = parse_json<get_table_rows_params>(request);
-    bool                   primary          = false;
-    auto                   table_with_index = get_table_index_name(params, primary);
-    std::unique_ptr<::abi> abi              = params.json ? get_abi(params.code, context.head) : nullptr;
-    auto                   table_type       = get_table_type(abi.get(), abieos::name{params.table.value});
-    auto                   scope            = guess_uint64(params.scope, "scope");
+    auto     params           = parse_json<get_table_rows_params>(request);
+    bool     primary          = false;
+    auto     table_with_index = get_table_index_name(params, primary);
+    uint32_t abi              = params.json ? get_abi(params.code, context.head) : 0;
+    auto     scope            = guess_uint64(params.scope, "scope");
 
     if (primary)
-        get_table_rows_primary(params, context, scope, table_type);
+        get_table_rows_primary(params, context, scope, abi);
     else if (params.key_type == "i64" || params.key_type == "name")
-        get_table_rows_secondary<uint64_t>(params, context, scope, table_type);
+        get_table_rows_secondary<uint64_t>(params, context, scope, abi);
     else
         eosio_assert(false, ("unsupported key_type: " + (std::string)params.key_type).c_str());
 }
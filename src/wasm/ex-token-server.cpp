@@ -17,9 +17,10 @@ struct transfer {
     std::string_view memo     = {nullptr, 0};
 };
 
-void process(token_transfer_request& req, const context_data& context) {
+void process(token_transfer_request& req, lazy_context_data& context) {
     print("    transfers\n");
-    auto s = exec_query(query_action_trace_executed_range_name_receiver_account_block_trans_action{
+    token_transfer_response response;
+    auto                    req_query = query_action_trace_executed_range_name_receiver_account_block_trans_action{
         .max_block = get_block_num(req.max_block, context),
         .first =
             {
@@ -40,11 +41,11 @@ void process(token_transfer_request& req, const context_data& context) {
                 .action_index     = req.last_key.action_index,
             },
         .max_results = req.max_results,
-    });
+    };
 
-    print(s.size(), "\n");
-    token_transfer_response response;
-    for_each_query_result<action_trace>(s, [&](action_trace& at) {
+    // action_trace rows can be large; stream them rather than holding the whole range. Anything
+    // kept from a row must be copied out since the row's buffer is reused by the next batch.
+    for_each_query_row<action_trace>(req_query, [&](action_trace& at) {
         response.more = token_transfer_key{
             .receipt_receiver = at.receipt_receiver,
             .account          = at.account,
@@ -67,7 +68,7 @@ void process(token_transfer_request& req, const context_data& context) {
                 .from     = unpacked.from,
                 .to       = unpacked.to,
                 .quantity = extended_asset{unpacked.quantity, at.account},
-                .memo     = unpacked.memo,
+                .memo     = std::string{unpacked.memo},
             });
         }
         return true;
@@ -78,7 +79,7 @@ void process(token_transfer_request& req, const context_data& context) {
     print("\n");
 }
 
-void process(balances_for_multiple_accounts_request& req, const context_data& context) {
+void process(balances_for_multiple_accounts_request& req, lazy_context_data& context) {
     print("    balances_for_multiple_accounts\n");
     auto s = exec_query(query_contract_row_range_code_table_pk_scope{
         .max_block = get_block_num(req.max_block, context),
@@ -114,7 +115,7 @@ void process(balances_for_multiple_accounts_request& req, const context_data& co
     print("\n");
 }
 
-void process(balances_for_multiple_tokens_request& req, const context_data& context) {
+void process(balances_for_multiple_tokens_request& req, lazy_context_data& context) {
     print("    balances_for_multiple_tokens\n");
     auto s = exec_query(query_contract_row_range_scope_table_pk_code{
         .max_block = get_block_num(req.max_block, context),
@@ -158,5 +159,6 @@ void process(balances_for_multiple_tokens_request& req, const context_data& cont
 extern "C" void startup() {
     auto request = unpack<token_request>(get_input_data());
     print("request: ", token_request::keys[request.value.index()], "\n");
-    std::visit([](auto& x) { process(x, get_context_data()); }, request.value);
+    lazy_context_data context;
+    std::visit([&](auto& x) { process(x, context); }, request.value);
 }
@@ -42,7 +42,7 @@ struct token_transfer {
     eosio::name           from     = {};
     eosio::name           to       = {};
     eosio::extended_asset quantity = {};
-    std::string_view      memo     = {nullptr, 0};
+    std::string           memo     = {};
 
     EOSLIB_SERIALIZE(token_transfer, (key)(from)(to)(quantity)(memo))
 };
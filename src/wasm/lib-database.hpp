@@ -3,6 +3,7 @@
 #pragma once
 #include "lib-placeholders.hpp"
 #include <eosiolib/time.hpp>
+#include <optional>
 
 extern "C" void exec_query(void* req_begin, void* req_end, void* cb_alloc_data, void* (*cb_alloc)(void* cb_alloc_data, size_t size));
 
@@ -40,6 +41,70 @@ bool for_each_query_result(const std::vector<char>& bytes, F f) {
     return true;
 }
 
+extern "C" uint32_t query_open(void* req_begin, void* req_end, uint32_t batch_size);
+extern "C" uint32_t
+query_next(uint32_t cursor, uint32_t max_rows, void* cb_alloc_data, void* (*cb_alloc)(void* cb_alloc_data, size_t size));
+extern "C" void     query_close(uint32_t cursor);
+
+// Like exec_query followed by for_each_query_result, but fetches batch_size rows at a time through a
+// cursor, so memory stays bounded and returning false from f stops the query early. Requests whose
+// max_results fits in one batch skip the cursor. Rows point into the current batch; don't keep them
+// past f.
+template <typename result, typename T, typename F>
+bool for_each_query_row(const T& req, F f, uint32_t batch_size = 100) {
+    auto              req_data = eosio::pack(req);
+    uint32_t          cursor   = query_open(req_data.data(), req_data.data() + req_data.size(), batch_size);
+    std::vector<char> bytes;
+    auto              alloc_fn = [&bytes](size_t size) {
+        bytes.resize(size);
+        return bytes.data();
+    };
+    while (true) {
+        auto num_rows = query_next(cursor, batch_size, &alloc_fn, [](void* cb_alloc_data, size_t size) -> void* {
+            return (*reinterpret_cast<decltype(alloc_fn)*>(cb_alloc_data))(size);
+        });
+        if (!for_each_query_result<result>(bytes, f)) {
+            query_close(cursor);
+            return false;
+        }
+        if (num_rows < batch_size)
+            break;
+    }
+    query_close(cursor);
+    return true;
+}
+
+// The host parses each ABI once and shares it between requests. Handles are only valid until the
+// current query returns.
+extern "C" uint32_t abi_prepare(const char* begin, const char* end);
+extern "C" bool     abi_table_to_json(
+    const char* begin, const char* end, uint32_t abi, void* cb_alloc_data, void* (*cb_alloc)(void* cb_alloc_data, size_t size));
+
+struct abi_prepare_key {
+    eosio::name account     = {};
+    uint32_t    block_index = {}; // of the account row which holds the ABI
+};
+
+// Returns 0 if the ABI is invalid
+inline uint32_t abi_prepare(eosio::name account, uint32_t block_index, const char* abi, size_t size) {
+    auto req = eosio::pack(abi_prepare_key{account, block_index});
+    req.insert(req.end(), abi, abi + size);
+    return abi_prepare(req.data(), req.data() + req.size());
+}
+
+// Returns false if the ABI has no type for table or bin doesn't match it
+inline bool abi_table_to_json(uint32_t abi, eosio::name table, const char* bin, size_t size, std::string& json) {
+    auto req = eosio::pack(table);
+    req.insert(req.end(), bin, bin + size);
+    auto alloc_fn = [&json](size_t size) {
+        json.resize(size);
+        return json.data();
+    };
+    return abi_table_to_json(req.data(), req.data() + req.size(), abi, &alloc_fn, [](void* cb_alloc_data, size_t size) -> void* {
+        return (*reinterpret_cast<decltype(alloc_fn)*>(cb_alloc_data))(size);
+    });
+}
+
 struct context_data {
     uint32_t           head            = {};
     eosio::checksum256 head_id         = {};
@@ -79,6 +144,18 @@ inline context_data get_context_data() {
     return result;
 }
 
+// Fetches the context on first use. The host's response cache treats a reply as depending on head
+// once the wasm reads the context, so requests which only select absolute blocks shouldn't read it.
+struct lazy_context_data {
+    std::optional<context_data> data = {};
+
+    const context_data& get() {
+        if (!data)
+            data = get_context_data();
+        return *data;
+    }
+};
+
 // todo: split out definitions useful for client-side
 using absolute_block     = tagged_type<"absolute"_n, int32_t>;
 using head_block         = tagged_type<"head"_n, int32_t>;
@@ -91,11 +168,12 @@ inline block_select make_absolute_block(int32_t i) {
     return result;
 }
 
-inline uint32_t get_block_num(const block_select& sel, const context_data& context) {
+// Only head- and irreversible-relative selections read the context
+inline uint32_t get_block_num(const block_select& sel, lazy_context_data& context) {
     switch (sel.value.index()) {
     case 0: return std::max((int32_t)0, std::get<0>(sel.value));
-    case 1: return std::max((int32_t)0, (int32_t)context.head + std::get<1>(sel.value));
-    case 2: return std::max((int32_t)0, (int32_t)context.irreversible + std::get<2>(sel.value));
+    case 1: return std::max((int32_t)0, (int32_t)context.get().head + std::get<1>(sel.value));
+    case 2: return std::max((int32_t)0, (int32_t)context.get().irreversible + std::get<2>(sel.value));
     default: return 0x7fff'ffff;
     }
 }
@@ -4,6 +4,7 @@
 #include "lib-placeholders.hpp"
 #include "lib-tagged-variant.hpp"
 #include <date/date.h>
+#include <string>
 #include <vector>
 
 // todo: replace
@@ -19,6 +20,8 @@ __attribute__((noinline)) inline void to_json(std::string_view sv, std::vector<c
     dest.push_back('"');
 }
 
+inline void to_json(std::string& s, std::vector<char>& dest) { to_json(std::string_view{s}, dest); }
+
 __attribute__((noinline)) inline void to_json(bool value, std::vector<char>& dest) {
     static const char t[] = "true";
     static const char f[] = "false";
@@ -197,6 +197,12 @@ extern "C" void set_output_data(const char* begin, const char* end);
 inline void     set_output_data(const std::vector<char>& v) { set_output_data(v.data(), v.data() + v.size()); }
 inline void     set_output_data(const std::string_view& v) { set_output_data(v.data(), v.data() + v.size()); }
 
+// Adds to the output instead of replacing it. The server may send what it has so far before the wasm
+// finishes, so a later set_output_data only replaces output which hasn't been sent yet.
+extern "C" void append_output_data(const char* begin, const char* end);
+inline void     append_output_data(const std::vector<char>& v) { append_output_data(v.data(), v.data() + v.size()); }
+inline void     append_output_data(const std::string_view& v) { append_output_data(v.data(), v.data() + v.size()); }
+
 using chain_request = tagged_variant<                //
     serialize_tag_as_name,                           //
     tagged_type<"block.info"_n, block_info_request>, //
@@ -1,6 +1,7 @@
 // copyright defined in LICENSE.txt
 
 #include "wasm_interface.hpp"
+#include <cstdint>
 #include <iostream>
 
 using namespace std::literals;
@@ -141,6 +142,7 @@ bool get_context_data(JSContext* cx, unsigned argc, JS::Value* vp) {
     JS::CallArgs args  = CallArgsFromVp(argc, vp);
     if (!args.requireAtLeast(cx, "get_context_data", 1))
         return false;
+    state.read_context = true;
     try {
         auto data = get_mem_from_callback(cx, args, 0, state.context_data.size());
         if (!js_assert(data, cx, "get_context_data: failed to fetch buffer from callback"))
@@ -161,13 +163,14 @@ bool get_input_data(JSContext* cx, unsigned argc, JS::Value* vp) {
     if (!args.requireAtLeast(cx, "get_input_data", 1))
         return false;
     try {
-        auto size = state.request.end - state.request.pos;
-        if (!js_assert((uint32_t)size == size, cx, "get_input_data: request is too big"))
+        auto size = state.request_prefix.size() + (state.request.end - state.request.pos);
+        if (!js_assert(size <= INT32_MAX, cx, "get_input_data: request is too big"))
             return false;
         auto data = get_mem_from_callback(cx, args, 0, size);
         if (!js_assert(data, cx, "get_input_data: failed to fetch buffer from callback"))
             return false;
-        memcpy(data, state.request.pos, size);
+        memcpy(data, state.request_prefix.data(), state.request_prefix.size());
+        memcpy(data + state.request_prefix.size(), state.request.pos, state.request.end - state.request.pos);
         return true;
     } catch (const std::exception& e) {
         return js_assert(false, cx, ("get_input_data: "s + e.what()).c_str());
@@ -176,6 +179,7 @@ bool get_input_data(JSContext* cx, unsigned argc, JS::Value* vp) {
     }
 } // get_input_data
 
+// Writes straight into the caller's buffer, which is usually the HTTP response body
 // args: ArrayBuffer, row_request_begin, row_request_end
 bool set_output_data(JSContext* cx, unsigned argc, JS::Value* vp) {
     auto&        state = wasm_state::from_context(cx);
@@ -186,15 +190,82 @@ bool set_output_data(JSContext* cx, unsigned argc, JS::Value* vp) {
     {
         JS::AutoCheckCannotGC checkGC;
         auto                  b = get_input_buffer(args, 0, 1, 2, checkGC);
-        if (b.pos) {
+        if (b.pos && state.output) {
             try {
-                state.reply.assign(b.pos, b.end);
+                auto& out = *state.output;
+                out.resize(state.output_begin);
+                if (state.output_sized)
+                    abieos::push_varuint32(out, b.end - b.pos);
+                out.insert(out.end(), b.pos, b.end);
+                state.output_appended = false;
             } catch (...) {
                 ok = false;
             }
+        } else {
+            ok = false;
         }
     }
     return js_assert(ok, cx, "set_output_data: invalid args");
 }
 
+// args: ArrayBuffer, row_request_begin, row_request_end
+bool append_output_data(JSContext* cx, unsigned argc, JS::Value* vp) {
+    auto&        state = wasm_state::from_context(cx);
+    JS::CallArgs args  = CallArgsFromVp(argc, vp);
+    if (!args.requireAtLeast(cx, "append_output_data", 3))
+        return false;
+    bool ok = true;
+    {
+        JS::AutoCheckCannotGC checkGC;
+        auto                  b = get_input_buffer(args, 0, 1, 2, checkGC);
+        if (b.pos && state.output) {
+            try {
+                auto& out = *state.output;
+                if (state.output_sized && !state.output_appended && out.size() > state.output_begin) {
+                    // drop the size which set_output_data wrote; finish_output replaces it
+                    abieos::input_buffer prefix{out.data() + state.output_begin, out.data() + out.size()};
+                    abieos::bin_to_native<abieos::varuint32>(prefix);
+                    out.erase(out.begin() + state.output_begin, out.begin() + (prefix.pos - out.data()));
+                }
+                state.output_appended = true;
+                out.insert(out.end(), b.pos, b.end);
+            } catch (...) {
+                ok = false;
+            }
+        } else {
+            ok = false;
+        }
+    }
+    if (!js_assert(ok, cx, "append_output_data: invalid args"))
+        return false;
+
+    auto& out = *state.output;
+    if (state.output_sized || !state.flush_output || out.size() < state.flush_size)
+        return true;
+    try {
+        state.flush_output(out);
+        out.clear();
+        state.output_begin = 0;
+        return true;
+    } catch (const std::exception& e) {
+        return js_assert(false, cx, ("append_output_data: "s + e.what()).c_str());
+    } catch (...) {
+        return js_assert(false, cx, "append_output_data error");
+    }
+}
+
+void finish_output(wasm_state& state) {
+    if (!state.output || !state.output_sized)
+        return;
+    auto& out = *state.output;
+    if (state.output_appended) {
+        std::vector<char> prefix;
+        abieos::push_varuint32(prefix, out.size() - state.output_begin);
+        out.insert(out.begin() + state.output_begin, prefix.begin(), prefix.end());
+    } else if (out.size() == state.output_begin) {
+        abieos::push_varuint32(out, 0);
+    }
+    state.output_appended = false;
+}
+
 } // namespace wasm
@@ -3,6 +3,7 @@
 #pragma once
 
 #include "abieos.hpp"
+#include <functional>
 
 #include "jsapi.h"
 
@@ -31,10 +32,20 @@ struct context_wrapper {
 struct wasm_state {
     context_wrapper      context;
     JS::RootedObject     global;
-    bool                 console      = {};
-    std::vector<char>    context_data = {};
-    abieos::input_buffer request      = {}; // todo: rename
-    std::vector<char>    reply        = {}; // todo: rename
+    bool                 console         = {};
+    std::vector<char>    context_data    = {};
+    bool                 read_context    = {}; // get_context_data was called since this was last cleared
+    std::vector<char>    request_prefix  = {}; // get_input_data returns request_prefix followed by request
+    abieos::input_buffer request         = {}; // todo: rename
+    std::vector<char>*   output          = {}; // set_output_data replaces everything past output_begin
+    size_t               output_begin    = {};
+    bool                 output_sized    = {}; // prefix the output with its varuint32 size
+    bool                 output_appended = {}; // output came from append_output_data, so finish_output adds the size
+
+    // If set, append_output_data hands the output to flush_output and clears it once it reaches
+    // flush_size. Only for unsized output which starts at the beginning of its buffer.
+    std::function<void(const std::vector<char>&)> flush_output = {};
+    size_t                                        flush_size   = 64 * 1024;
 
     wasm_state()
         : global(context.cx) {
@@ -63,5 +74,8 @@ bool print_wasm_str(JSContext* cx, unsigned argc, JS::Value* vp);
 bool get_context_data(JSContext* cx, unsigned argc, JS::Value* vp);
 bool get_input_data(JSContext* cx, unsigned argc, JS::Value* vp);
 bool set_output_data(JSContext* cx, unsigned argc, JS::Value* vp);
+bool append_output_data(JSContext* cx, unsigned argc, JS::Value* vp);
+
+void finish_output(wasm_state& state);
 
 } // namespace wasm
@@ -1,9 +1,6 @@
 // copyright defined in LICENSE.txt
 
 // todo: balance history
-// todo: timeout wasm
-// todo: timeout sql
-// todo: what should memory size limit be?
 // todo: check callbacks for recursion to limit stack size
 // todo: make sure spidermonkey limits stack size
 // todo: global constructors in wasm
@@ -20,16 +17,31 @@
 // todo: better naming for queries
 
 #include "wasm_ql_plugin.hpp"
+#include "lru_cache.hpp"
+#include "metrics.hpp"
 #include "queries.hpp"
+#include "response_cache.hpp"
+#include "trace.hpp"
 #include "wasm_interface.hpp"
 
+#include <atomic>
+#include <boost/asio/signal_set.hpp>
 #include <boost/beast/core.hpp>
-#include <boost/beast/http/vector_body.hpp>
+#include <boost/beast/http.hpp>
 #include <boost/beast/websocket.hpp>
+#include <boost/filesystem.hpp>
 #include <boost/signals2/connection.hpp>
+#include <cmath>
+#include <condition_variable>
+#include <csignal>
+#include <cstdint>
 #include <fc/exception/exception.hpp>
 #include <fc/io/datastream.hpp>
 #include <fstream>
+#include <future>
+#include <map>
+#include <mutex>
+#include <thread>
 
 using namespace abieos;
 using namespace appbase;
@@ -55,261 +67,1822 @@ std::string read_string(const char* filename) {
     }
 }
 
+template <typename F>
+auto catch_and_log(F f) {
+    try {
+        return f();
+    } catch (const fc::exception& e) {
+        elog("${e}", ("e", e.to_detail_string()));
+    } catch (const std::exception& e) {
+        elog("${e}", ("e", e.what()));
+    } catch (...) {
+        elog("unknown exception");
+    }
+}
+
+struct fill_status {
+    uint32_t            head            = {};
+    abieos::checksum256 head_id         = {};
+    uint32_t            irreversible    = {};
+    abieos::checksum256 irreversible_id = {};
+    uint32_t            first           = {};
+};
+
+fill_status fetch_fill_status(pg::connection& conn, const std::string& schema) {
+    auto result =
+        conn.exec("select head, head_id, irreversible, irreversible_id, first from \"" + schema + "\".fill_status", pg::format::binary);
+    if (result.empty())
+        throw std::runtime_error("fill_status is empty");
+
+    fill_status status;
+    status.head            = query_config::sql_to_int(result.get(0, 0));
+    status.head_id         = query_config::sql_to_checksum256(result.get(0, 1).data);
+    status.irreversible    = query_config::sql_to_int(result.get(0, 2));
+    status.irreversible_id = query_config::sql_to_checksum256(result.get(0, 3).data);
+    status.first           = query_config::sql_to_int(result.get(0, 4));
+    return status;
+}
+
+// Keeps the latest fill_status so requests don't have to read it. A background thread refreshes it
+// every interval, or as soon as a notification arrives on channel if the filler sends them.
+struct fill_status_listener {
+    using callback = std::function<void(const fill_status&)>;
+
+    const std::string                  schema;
+    const std::string                  channel;
+    const std::chrono::milliseconds    interval;
+    std::shared_ptr<const fill_status> current        = {}; // only use through the std::atomic_* functions
+    std::atomic<bool>                  stopping       = false;
+    std::thread                        thread;
+    callback                           on_head_change = {}; // runs on the listener's thread; set before start()
+
+    fill_status_listener(std::string schema, std::string channel, std::chrono::milliseconds interval)
+        : schema(std::move(schema))
+        , channel(std::move(channel))
+        , interval(interval) {}
+
+    ~fill_status_listener() { stop(); }
+
+    std::shared_ptr<const fill_status> get() const { return std::atomic_load(&current); }
+
+    void start() {
+        pg::connection conn;
+        std::atomic_store(&current, std::make_shared<const fill_status>(fetch_fill_status(conn, schema)));
+        thread = std::thread([this] { run(); });
+    }
+
+    void stop() {
+        stopping = true;
+        if (thread.joinable())
+            thread.join();
+    }
+
+    void run() {
+        while (!stopping) {
+            try {
+                pg::connection conn;
+                if (!channel.empty())
+                    conn.exec("listen \"" + channel + "\"");
+                while (!stopping) {
+                    auto status = std::make_shared<const fill_status>(fetch_fill_status(conn, schema));
+                    auto prev   = std::atomic_exchange(&current, status);
+                    if (on_head_change && prev->head_id.value != status->head_id.value)
+                        catch_and_log([&] { on_head_change(*status); });
+                    conn.wait_for_notification(interval);
+                }
+            } catch (const std::exception& e) {
+                elog("fill_status: ${e}", ("e", e.what()));
+                std::this_thread::sleep_for(std::chrono::seconds(1));
+            }
+        }
+    }
+}; // fill_status_listener
+
+struct query_limits {
+    std::chrono::milliseconds timeout     = {}; // wall clock, per call into a wasm; 0 is unlimited
+    std::chrono::milliseconds sql_timeout = {}; // statement_timeout; 0 is unlimited
+    uint32_t                  max_memory  = {}; // bytes of wasm linear memory; 0 is unlimited
+};
+
+// max_memory for a limit in MB. Anything above 4095 would overflow uint32_t, and 4096 would wrap to 0
+// (unlimited).
+uint32_t memory_limit_bytes(unsigned long mb) {
+    if (mb > 4095)
+        throw std::runtime_error("memory limit must not be above 4095 MB");
+    return mb * 1024 * 1024;
+}
+
+// NAME:TIMEOUT_MS:SQL_TIMEOUT_MS:MEMORY_MB
+std::pair<std::string, query_limits> parse_wasm_limit(const std::string& s) {
+    std::vector<std::string> parts;
+    for (size_t pos = 0;;) {
+        auto end = s.find(':', pos);
+        parts.push_back(s.substr(pos, end == std::string::npos ? end : end - pos));
+        if (end == std::string::npos)
+            break;
+        pos = end + 1;
+    }
+    try {
+        if (parts.size() != 4 || parts[0].empty())
+            throw std::runtime_error("");
+        query_limits limits;
+        limits.timeout     = std::chrono::milliseconds(std::stoul(parts[1]));
+        limits.sql_timeout = std::chrono::milliseconds(std::stoul(parts[2]));
+        limits.max_memory  = memory_limit_bytes(std::stoul(parts[3]));
+        return {parts[0], limits};
+    } catch (...) {
+        throw std::runtime_error("invalid wasm-limit: " + s + "; expected NAME:TIMEOUT_MS:SQL_TIMEOUT_MS:MEMORY_MB");
+    }
+}
+
+struct warmup_request {
+    std::string       target = {};
+    std::vector<char> body   = {};
+};
+
+// TARGET=BODY, or TARGET=@FILE to read the body from a file
+warmup_request parse_warmup_request(const std::string& s) {
+    auto pos = s.find('=');
+    if (pos == std::string::npos || !pos || s[0] != '/')
+        throw std::runtime_error("invalid warmup-request: " + s + "; expected TARGET=BODY or TARGET=@FILE");
+    warmup_request result{s.substr(0, pos)};
+    auto           body = s.substr(pos + 1);
+    if (!body.empty() && body[0] == '@')
+        body = read_string(body.c_str() + 1);
+    result.body.assign(body.begin(), body.end());
+    return result;
+}
+
+struct state;
+
+// Interrupts wasm which runs past its deadline. SpiderMonkey runs the context's interrupt callback on
+// the context's own thread at its next check (e.g. a loop header); returning false there terminates
+// the script. SQL isn't interruptible this way; statement_timeout covers it.
+struct watchdog {
+    using clock = std::chrono::steady_clock;
+
+    std::mutex                            mutex;
+    std::condition_variable               cv;
+    std::map<::state*, clock::time_point> deadlines = {};
+    bool                                  stopping  = false;
+    std::thread                           thread;
+
+    ~watchdog() { stop(); }
+
+    void start() {
+        thread = std::thread([this] { run(); });
+    }
+
+    void stop() {
+        {
+            std::lock_guard lock{mutex};
+            stopping = true;
+        }
+        cv.notify_all();
+        if (thread.joinable())
+            thread.join();
+    }
+
+    void arm(::state* s, clock::time_point deadline) {
+        std::lock_guard lock{mutex};
+        deadlines[s] = deadline;
+        cv.notify_all();
+    }
+
+    void disarm(::state* s) {
+        std::lock_guard lock{mutex};
+        deadlines.erase(s);
+    }
+
+    // Stops s's clock, e.g. while it writes to a slow client. Returns the time it had left; nothing
+    // if it wasn't armed.
+    std::optional<clock::duration> pause(::state* s) {
+        std::lock_guard lock{mutex};
+        auto            it = deadlines.find(s);
+        if (it == deadlines.end())
+            return {};
+        auto remaining = it->second - clock::now();
+        deadlines.erase(it);
+        return remaining;
+    }
+
+    void run();
+}; // watchdog
+
+// Shared between threads through abi_cache, so it's never modified once parsed. abieos's
+// bin_to_json takes a mutable abi_type, so each thread fills its own contract from def (see
+// thread_contract).
+struct parsed_abi {
+    std::vector<char> raw = {};
+    abieos::abi_def   def = {};
+};
+
+// Compiled modules, shared by every worker. Any context can wrap a compiled JS::WasmModule in its
+// own WebAssembly.Module, so a wasm only compiles once per process. Only the newest version of each
+// wasm is kept; a context which still uses an older one holds its own reference.
+struct module_cache {
+    struct entry {
+        size_t                 hash   = {}; // of the file
+        RefPtr<JS::WasmModule> module = {};
+    };
+
+    std::mutex                   mutex;
+    std::map<std::string, entry> modules; // by wasm name
+    std::atomic<uint64_t>        hits       = 0;
+    std::atomic<uint64_t>        compiles   = 0;
+    std::atomic<uint32_t>        generation = 0; // bumped by reloads; contexts drop their modules when it changes
+
+    // hash is the file's, or nullopt to take whichever version is cached
+    RefPtr<JS::WasmModule> get(const std::string& wasm_name, std::optional<size_t> hash) {
+        std::lock_guard lock{mutex};
+        auto            it = modules.find(wasm_name);
+        if (it == modules.end() || (hash && it->second.hash != *hash))
+            return nullptr;
+        ++hits;
+        return it->second.module;
+    }
+
+    // Two workers may compile the same wasm at once; either result will do
+    void put(const std::string& wasm_name, size_t hash, RefPtr<JS::WasmModule> module) {
+        std::lock_guard lock{mutex};
+        ++compiles;
+        modules[wasm_name] = entry{hash, std::move(module)};
+    }
+}; // module_cache
+
+// Served at /metrics. Time inside a wasm call is split into SQL, converting rows for the wasm, and
+// the rest, which is the wasm itself.
+struct server_metrics {
+    metrics::labeled_histogram wasm_call{"wasm_ql_wasm_call_seconds", "wasm", "Duration of successful calls into each wasm"};
+    metrics::labeled_histogram sql{"wasm_ql_sql_seconds", "query", "Time Postgres took to run each query"};
+    metrics::labeled_histogram serialize{"wasm_ql_serialize_seconds", "query", "Time spent converting each query's rows for the wasm"};
+    std::atomic<uint64_t>      wasm_ns      = 0;
+    std::atomic<uint64_t>      sql_ns       = 0;
+    std::atomic<uint64_t>      serialize_ns = 0;
+    std::atomic<uint64_t>      requests     = 0;
+    std::atomic<uint64_t>      errors       = 0;
+    std::atomic<uint64_t>      bytes_in     = 0; // request bodies
+    std::atomic<uint64_t>      bytes_out    = 0; // response bodies
+    std::atomic<int64_t>       connections  = 0;
+};
+
+// Read-only after plugin_initialize; shared by every worker thread
+struct shared_state {
+    query_config::config                          config                = {};
+    std::string                                   schema                = {};
+    bool                                          console               = {};
+    int                                           num_threads           = {};
+    asio::io_context*                             workers               = {};
+    std::shared_ptr<pg::pool>                     sql_pool              = {};
+    std::shared_ptr<fill_status_listener>         fill_status           = {};
+    std::shared_ptr<::watchdog>                   watchdog              = {};
+    query_limits                                  limits                = {};
+    std::map<std::string, query_limits>           wasm_limits           = {}; // overrides limits
+    std::shared_ptr<::response_cache>             response_cache        = {}; // null if disabled
+    std::shared_ptr<lru_cache<std::vector<char>>> result_cache          = {}; // exec_query results; null if disabled
+    std::shared_ptr<lru_cache<parsed_abi>>        abi_cache             = {}; // null if disabled
+    bool                                          native_get_table_rows = {};
+    std::shared_ptr<::module_cache>               module_cache          = {};
+    bool                                          precompile            = {}; // compile every wasm at startup
+    bool                                          allow_reload          = {};
+    std::vector<warmup_request>                   warmup_requests       = {};
+    int                                           warmup_rounds         = {};
+    std::shared_ptr<std::atomic<bool>>            ready                 = {}; // set once warm; cleared at shutdown
+    std::shared_ptr<server_metrics>               metrics               = {};
+    std::shared_ptr<tracing::sink>                trace_sink            = {}; // null if tracing is off
+    double                                        trace_sample_rate     = {};
+    std::shared_ptr<std::atomic<uint64_t>>        num_traceable         = {}; // requests seen, for sampling
+
+    const query_limits& get_limits(const std::string& wasm_name) const {
+        auto it = wasm_limits.find(wasm_name);
+        return it == wasm_limits.end() ? limits : it->second;
+    }
+
+    // The id of a new trace, or 0 if the request isn't traced. Requests which ask for it are always
+    // traced; trace_sample_rate of the others are, spread evenly rather than randomly.
+    uint64_t start_trace(bool requested) const {
+        if (!trace_sink)
+            return 0;
+        auto n = ++*num_traceable;
+        if (requested || std::floor(n * trace_sample_rate) != std::floor((n - 1) * trace_sample_rate))
+            return n;
+        return 0;
+    }
+};
+
+// Owned by a single worker thread. SpiderMonkey contexts are bound to the thread which created them.
 struct state : wasm_state {
-    query_config::config config          = {};
-    std::string          schema          = {};
-    pqxx::connection     sql_connection  = {};
-    uint32_t             head            = {};
-    abieos::checksum256  head_id         = {};
-    uint32_t             irreversible    = {};
-    abieos::checksum256  irreversible_id = {};
-    uint32_t             first           = {};
+    // A cursor either is declared on sql_connection or, if the whole result fit in the first batch,
+    // holds that result until query_next hands it over.
+    struct cursor {
+        const query_config::query*               query    = nullptr;
+        bool                                     declared = {};
+        std::shared_ptr<const std::vector<char>> result   = {};
+    };
+
+    // This thread's contracts for the ABIs it has converted rows with. Holding the ABI keeps the key
+    // from being reused.
+    struct abi_contract {
+        std::shared_ptr<const parsed_abi> abi      = {};
+        abieos::contract                  contract = {};
+    };
+
+    static constexpr size_t max_contracts = 256;
+
+    using cursor_map   = std::map<uint32_t, cursor>;
+    using abi_list     = std::vector<std::shared_ptr<const parsed_abi>>;
+    using contract_map = std::map<const parsed_abi*, abi_contract>;
+
+    std::shared_ptr<const shared_state> shared                 = {};
+    pg::connection*                     sql_connection         = {}; // checked out of sql_pool for the current request
+    ::fill_status                       fill                   = {}; // as of the start of the current request
+    uint32_t                            last_cursor            = {};
+    cursor_map                          cursors                = {};
+    std::optional<int64_t>              sql_timeout            = {}; // statement_timeout set in the current transaction
+    std::atomic<bool>                   timed_out              = false;
+    abi_list                            abis                   = {}; // abi_prepare handles for the current call
+    contract_map                        contracts              = {}; // at most max_contracts
+    bool                                read_past_irreversible = {}; // a query may have seen reversible blocks
+    metrics::clock::duration            db_time                = {}; // SQL and row conversion, since the thread started
+    tracing::trace*                     trace                  = {}; // the current request's, if it's traced
+    std::vector<size_t>                 js_spans               = {}; // trace_begin calls which haven't ended
+
+    state(std::shared_ptr<const shared_state> shared)
+        : shared(std::move(shared)) {
+        console = this->shared->console;
+        JS_AddInterruptCallback(context.cx, interrupt_callback);
+    }
+
+    static state& from_context(JSContext* cx) { return *reinterpret_cast<state*>(JS_GetContextPrivate(cx)); }
+
+    static bool interrupt_callback(JSContext* cx) { return !from_context(cx).timed_out; }
+
+    // Whether the output of the current request may change when head moves
+    bool depends_on_head() const { return read_context || read_past_irreversible; }
+
+    void clear_depends_on_head() {
+        read_context           = false;
+        read_past_irreversible = false;
+    }
+};
+
+void watchdog::run() {
+    std::unique_lock lock{mutex};
+    while (!stopping) {
+        auto now  = clock::now();
+        auto next = clock::time_point::max();
+        for (auto it = deadlines.begin(); it != deadlines.end();) {
+            if (it->second <= now) {
+                it->first->timed_out = true;
+                JS_RequestInterruptCallback(it->first->context.cx);
+                it = deadlines.erase(it);
+            } else {
+                next = std::min(next, it->second);
+                ++it;
+            }
+        }
+        if (next == clock::time_point::max())
+            cv.wait(lock);
+        else
+            cv.wait_until(lock, next);
+    }
+}
+
+static thread_local ::state* thread_state = nullptr;
+
+// Loads wasm_name-server.wasm into the current realm, compiling it only if no other worker already
+// has. The file is only read if the wasm isn't in module_cache yet, or if check_file is set;
+// precompile_wasms sets it, so a reload reads and hashes each file once rather than once per worker.
+// Returns null if compiling failed, with the exception pending.
+JSObject* load_wasm_module(::state& state, const std::string& wasm_name, bool check_file = false) {
+    // todo: sanitize wasm_name
+    auto  filename = wasm_name + "-server.wasm";
+    auto  cx       = state.context.cx;
+    auto& cache    = *state.shared->module_cache;
+    if (!check_file)
+        if (auto compiled = cache.get(wasm_name, std::nullopt))
+            return compiled->createObject(cx);
+    auto code = read_string(filename.c_str());
+    if (code.empty())
+        throw std::runtime_error("can not read " + filename);
+    auto hash = std::hash<std::string>{}(code);
+    if (auto compiled = cache.get(wasm_name, hash))
+        return compiled->createObject(cx);
+
+    auto data = malloc(code.size());
+    if (!data)
+        throw std::runtime_error("out of memory reading " + filename);
+    memcpy(data, code.data(), code.size());
+    JS::RootedObject buffer(cx, JS_NewArrayBufferWithContents(cx, code.size(), data));
+    if (!buffer) {
+        free(data);
+        return nullptr;
+    }
+    JS::RootedValue webassembly(cx);
+    JS::RootedValue constructor(cx);
+    if (!JS_GetProperty(cx, state.global, "WebAssembly", &webassembly) || !webassembly.isObject())
+        throw std::runtime_error("WebAssembly is missing");
+    JS::RootedObject webassembly_obj(cx, &webassembly.toObject());
+    if (!JS_GetProperty(cx, webassembly_obj, "Module", &constructor))
+        throw std::runtime_error("WebAssembly.Module is missing");
+    JS::AutoValueArray<1> args(cx);
+    args[0].setObject(*buffer);
+    JS::RootedObject module(cx);
+    if (!JS::Construct(cx, constructor, JS::HandleValueArray(args), &module))
+        return nullptr;
+    cache.put(wasm_name, hash, JS::GetWasmModule(module));
+    return module;
+}
+
+// args: wasm_name
+// returns: WebAssembly.Module
+bool get_wasm_module(JSContext* cx, unsigned argc, JS::Value* vp) {
+    auto&        state = ::state::from_context(cx);
+    JS::CallArgs args  = CallArgsFromVp(argc, vp);
+    if (!args.requireAtLeast(cx, "get_wasm_module", 1))
+        return false;
+    std::string wasm_name;
+    if (!js_assert(args[0].isString() && convert_str(cx, args[0].toString(), wasm_name), cx, "get_wasm_module: invalid args"))
+        return false;
+    tracing::scoped_span span{state.trace, "load_module", "wasm", "\"wasm\":\"" + tracing::json_escape(wasm_name) + "\""};
+    try {
+        JS::RootedObject module(cx, load_wasm_module(state, wasm_name));
+        if (!module)
+            return false;
+        args.rval().setObject(*module);
+        return true;
+    } catch (const std::exception& e) {
+        return js_assert(false, cx, ("get_wasm_module: "s + e.what()).c_str());
+    } catch (...) {
+        return js_assert(false, cx, "get_wasm_module error");
+    }
+}
+
+std::string query_sql(const std::string& schema, const query_config::query& query) {
+    std::string sql = "select * from \"" + schema + "\"." + query.function + "(";
+    for (uint32_t i = 0; i < query.num_params; ++i)
+        sql += (i ? query_config::sep : "") + "$" + std::to_string(i + 1);
+    sql += ")";
+    return sql;
+}
+
+struct query_args {
+    const query_config::query*              query       = nullptr;
+    std::vector<std::optional<std::string>> params      = {};
+    bool                                    immutable   = {}; // only reads irreversible blocks
+    uint32_t                                max_results = {}; // after applying the query's limit
+
+    // Identifies the result; only meaningful if immutable
+    std::string cache_key() const {
+        std::string key = (std::string)query->wasm_name;
+        for (auto& param : params) {
+            if (param)
+                key += ":" + std::to_string(param->size()) + ":" + *param;
+            else
+                key += ":null";
+        }
+        return key;
+    }
+};
+
+// Decodes a query request: query name, max_block if the query takes one, args, the range, then
+// max_results
+void decode_query_args(::state& state, input_buffer args_buf, query_args& result) {
+    auto& query  = result.query;
+    auto& params = result.params;
+
+    abieos::name query_name;
+    abieos::bin_to_native(query_name, args_buf);
+    auto it = state.shared->config.query_map.find(query_name);
+    if (it == state.shared->config.query_map.end())
+        throw std::runtime_error("unknown query: " + (std::string)query_name);
+    query = it->second;
+
+    params.reserve(query->num_params);
+    if (query->limit_block_index) {
+        auto max_block = std::min(state.fill.head, abieos::bin_to_native<uint32_t>(args_buf));
+        if (max_block > state.fill.irreversible)
+            state.read_past_irreversible = true;
+        else
+            result.immutable = true;
+        params.push_back(sql_conversion::sql_param(max_block));
+    } else {
+        state.read_past_irreversible = true;
+    }
+    auto add_args = [&](auto& args) {
+        for (auto& arg : args)
+            params.push_back(arg.bin_to_param(args_buf));
+    };
+    add_args(query->arg_types);
+    add_args(query->range_types);
+    add_args(query->range_types);
+    result.max_results = std::min(abieos::read_raw<uint32_t>(args_buf), query->max_results);
+    params.push_back(sql_conversion::sql_param(result.max_results));
+}
+
+// Decodes a query request in place from wasm memory. Nothing here may call into JS while the memory
+// is borrowed, so errors are reported after it is released.
+bool get_query_args(JSContext* cx, JS::CallArgs& args, const char* fn, query_args& result) {
+    auto&       state = ::state::from_context(cx);
+    std::string error;
+    {
+        JS::AutoCheckCannotGC checkGC;
+        auto                  args_buf = get_input_buffer(args, 0, 1, 2, checkGC);
+        try {
+            if (!args_buf.pos)
+                throw std::runtime_error("invalid args");
+            decode_query_args(state, args_buf, result);
+        } catch (const std::exception& e) {
+            error = e.what();
+        } catch (...) {
+            error = "error";
+        }
+    }
+    return js_assert(error.empty(), cx, (fn + ": "s + error).c_str());
+}
+
+std::vector<const char*> param_values(const std::vector<std::optional<std::string>>& params) {
+    std::vector<const char*> values;
+    values.reserve(params.size());
+    for (auto& param : params)
+        values.push_back(param ? param->c_str() : nullptr);
+    return values;
+}
+
+// Produces the row count followed by each row prefixed with its size
+std::vector<char> rows_to_bin(const pg::result& exec_result, const query_config::query& query) {
+    if (exec_result.columns() != (int)query.result_types.size())
+        throw std::runtime_error("unexpected column count from " + query.function);
+    std::vector<char> result_bin;
+    std::vector<char> row_bin;
+    push_varuint32(result_bin, exec_result.size());
+    for (int row = 0; row < exec_result.size(); ++row) {
+        row_bin.clear();
+        int i = 0;
+        for (auto& type : query.result_types) {
+            type.sql_to_bin(row_bin, exec_result.get(row, i));
+            ++i;
+        }
+        if ((uint32_t)row_bin.size() != row_bin.size())
+            throw std::runtime_error("row is too big");
+        push_varuint32(result_bin, row_bin.size());
+        result_bin.insert(result_bin.end(), row_bin.begin(), row_bin.end());
+    }
+    if (result_bin.size() > INT32_MAX)
+        throw std::runtime_error("result is too big");
+    return result_bin;
+}
+
+// start to sql_done is Postgres' time; the rest is rows_to_bin
+void record_query(
+    ::state& state, const query_config::query& query, metrics::clock::time_point start, metrics::clock::time_point sql_done,
+    metrics::clock::time_point end) {
+    auto& m    = *state.shared->metrics;
+    auto  name = (std::string)query.wasm_name;
+    m.sql.get(name).observe(sql_done - start);
+    m.serialize.get(name).observe(end - sql_done);
+    m.sql_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(sql_done - start).count();
+    m.serialize_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(end - sql_done).count();
+    state.db_time += end - start;
+    if (state.trace) {
+        state.trace->add("sql", "sql", start, sql_done);
+        state.trace->add("sql_to_bin", "sql", sql_done, end);
+    }
+}
+
+// Runs a decoded query, or finds its result in result_cache
+std::shared_ptr<const std::vector<char>> exec_query_args(::state& state, const query_args& qa) {
+    tracing::scoped_span span{state.trace, "exec_query", "sql", "\"query\":\"" + (std::string)qa.query->wasm_name + "\""};
+
+    auto&                                    cache = state.shared->result_cache;
+    std::string                              cache_key;
+    std::shared_ptr<const std::vector<char>> result_bin;
+    if (cache && qa.immutable) {
+        cache_key  = qa.cache_key();
+        result_bin = cache->get(cache_key, [](auto&) { return true; });
+        if (result_bin && state.trace)
+            state.trace->spans[span.index].args += ",\"cached\":true";
+    }
+    if (!result_bin) {
+        auto start = metrics::clock::now();
+        auto exec_result =
+            state.sql_connection->exec_prepared((std::string)qa.query->wasm_name, param_values(qa.params), pg::format::binary);
+        auto sql_done = metrics::clock::now();
+        result_bin    = std::make_shared<const std::vector<char>>(rows_to_bin(exec_result, *qa.query));
+        record_query(state, *qa.query, start, sql_done, metrics::clock::now());
+        if (cache && qa.immutable)
+            cache->put(std::move(cache_key), result_bin, result_bin->size());
+    }
+    return result_bin;
+}
+
+// args: ArrayBuffer, row_request_begin, row_request_end, callback
+bool exec_query(JSContext* cx, unsigned argc, JS::Value* vp) {
+    auto&        state = ::state::from_context(cx);
+    JS::CallArgs args  = CallArgsFromVp(argc, vp);
+    if (!args.requireAtLeast(cx, "exec_query", 4))
+        return false;
+    query_args qa;
+    if (!get_query_args(cx, args, "exec_query", qa))
+        return false;
+
+    try {
+        auto result_bin = exec_query_args(state, qa);
+        auto data       = get_mem_from_callback(cx, args, 3, result_bin->size());
+        if (!js_assert(data, cx, "exec_query: failed to fetch buffer from callback"))
+            return false;
+        memcpy(data, result_bin->data(), result_bin->size());
+        return true;
+    } catch (const std::exception& e) {
+        return js_assert(false, cx, ("exec_query: "s + e.what()).c_str());
+    } catch (...) {
+        return js_assert(false, cx, "exec_query error");
+    }
+} // exec_query
+
+std::string cursor_name(uint32_t cursor) { return "wasm_ql_cursor_" + std::to_string(cursor); }
+
+// Opens a cursor within the request's snapshot. Takes the same request as exec_query. If max_results
+// fits in batch_size, the query runs now through exec_query_args, which uses the prepared statement
+// and result_cache, and the first query_next returns everything. Otherwise it declares a server-side
+// cursor. A batch_size of 0 always declares one.
+// args: ArrayBuffer, row_request_begin, row_request_end, batch_size
+// returns: cursor
+bool query_open(JSContext* cx, unsigned argc, JS::Value* vp) {
+    auto&        state = ::state::from_context(cx);
+    JS::CallArgs args  = CallArgsFromVp(argc, vp);
+    if (!args.requireAtLeast(cx, "query_open", 3))
+        return false;
+    query_args qa;
+    if (!get_query_args(cx, args, "query_open", qa))
+        return false;
+
+    uint32_t batch_size = args.get(3).isNumber() ? (uint32_t)args[3].toNumber() : 0;
+
+    try {
+        auto cursor = ++state.last_cursor;
+        if (batch_size && qa.max_results <= batch_size) {
+            state.cursors[cursor] = {qa.query, false, exec_query_args(state, qa)};
+        } else {
+            state.sql_connection->exec_params(
+                "declare " + cursor_name(cursor) + " no scroll cursor for " + query_sql(state.shared->schema, *qa.query),
+                param_values(qa.params));
+            state.cursors[cursor] = {qa.query, true};
+        }
+        args.rval().setNumber(cursor);
+        return true;
+    } catch (const std::exception& e) {
+        return js_assert(false, cx, ("query_open: "s + e.what()).c_str());
+    } catch (...) {
+        return js_assert(false, cx, "query_open error");
+    }
+} // query_open
+
+// Fetches up to max_rows more rows, in the same format as exec_query. Fewer rows than asked for
+// means the cursor is exhausted.
+// args: cursor, max_rows, callback
+// returns: number of rows
+bool query_next(JSContext* cx, unsigned argc, JS::Value* vp) {
+    auto&        state = ::state::from_context(cx);
+    JS::CallArgs args  = CallArgsFromVp(argc, vp);
+    if (!args.requireAtLeast(cx, "query_next", 3))
+        return false;
+    if (!js_assert(args[0].isNumber() && args[1].isNumber(), cx, "query_next: invalid args"))
+        return false;
+    auto cursor   = (uint32_t)args[0].toNumber();
+    auto max_rows = (uint32_t)args[1].toNumber();
+    auto it       = state.cursors.find(cursor);
+    if (!js_assert(it != state.cursors.end(), cx, "query_next: cursor is not open"))
+        return false;
+
+    auto& c = it->second;
+
+    try {
+        std::shared_ptr<const std::vector<char>> result_bin;
+        uint32_t                                 num_rows = 0;
+        if (c.declared) {
+            tracing::scoped_span span{state.trace, "query_next", "sql", "\"query\":\"" + (std::string)c.query->wasm_name + "\""};
+            auto                 start       = metrics::clock::now();
+            auto                 exec_result = state.sql_connection->exec(
+                "fetch forward " + std::to_string(max_rows) + " from " + cursor_name(cursor), pg::format::binary);
+            auto sql_done = metrics::clock::now();
+            result_bin    = std::make_shared<const std::vector<char>>(rows_to_bin(exec_result, *c.query));
+            num_rows      = exec_result.size();
+            record_query(state, *c.query, start, sql_done, metrics::clock::now());
+        } else if (c.result) {
+            // fetched by query_open
+            result_bin = std::move(c.result);
+            input_buffer buf{result_bin->data(), result_bin->data() + result_bin->size()};
+            num_rows = bin_to_native<varuint32>(buf).value;
+            if (num_rows > max_rows)
+                throw std::runtime_error("max_rows is smaller than query_open's batch_size");
+        } else {
+            result_bin = std::make_shared<const std::vector<char>>(1, 0); // exhausted: no rows
+        }
+        auto data = get_mem_from_callback(cx, args, 2, result_bin->size());
+        if (!js_assert(data, cx, "query_next: failed to fetch buffer from callback"))
+            return false;
+        memcpy(data, result_bin->data(), result_bin->size());
+        args.rval().setInt32(num_rows);
+        return true;
+    } catch (const std::exception& e) {
+        return js_assert(false, cx, ("query_next: "s + e.what()).c_str());
+    } catch (...) {
+        return js_assert(false, cx, "query_next error");
+    }
+} // query_next
+
+// args: cursor
+bool query_close(JSContext* cx, unsigned argc, JS::Value* vp) {
+    auto&        state = ::state::from_context(cx);
+    JS::CallArgs args  = CallArgsFromVp(argc, vp);
+    if (!args.requireAtLeast(cx, "query_close", 1))
+        return false;
+    if (!js_assert(args[0].isNumber(), cx, "query_close: invalid args"))
+        return false;
+    auto cursor = (uint32_t)args[0].toNumber();
+    auto it     = state.cursors.find(cursor);
+    if (!js_assert(it != state.cursors.end(), cx, "query_close: cursor is not open"))
+        return false;
+    bool declared = it->second.declared;
+    state.cursors.erase(it);
+    try {
+        if (declared)
+            state.sql_connection->exec("close " + cursor_name(cursor));
+        return true;
+    } catch (const std::exception& e) {
+        return js_assert(false, cx, ("query_close: "s + e.what()).c_str());
+    } catch (...) {
+        return js_assert(false, cx, "query_close error");
+    }
+} // query_close
+
+std::shared_ptr<const parsed_abi> parse_abi(input_buffer raw) {
+    auto             result = std::make_shared<parsed_abi>();
+    std::string      error;
+    abieos::contract contract;
+    result->raw.assign(raw.pos, raw.end);
+    if (!abieos::check_abi_version(input_buffer{raw}, error))
+        return nullptr;
+    if (!abieos::bin_to_native(result->def, error, raw))
+        return nullptr;
+    // only checks that the types resolve; each thread fills its own in thread_contract
+    if (!abieos::fill_contract(contract, error, result->def))
+        return nullptr;
+    return result;
+}
+
+// Parses an ABI, or finds it in abi_cache. The key is the account and the block of the account row
+// which holds the ABI. The raw bytes are compared too, in case a fork replaced that block. Returns
+// null if the ABI is invalid.
+std::shared_ptr<const parsed_abi> prepare_abi(::state& state, name account, uint32_t block_index, input_buffer raw) {
+    auto&                             cache = state.shared->abi_cache;
+    std::string                       key   = std::to_string(account.value) + ":" + std::to_string(block_index);
+    size_t                            size  = raw.end - raw.pos;
+    std::shared_ptr<const parsed_abi> abi;
+    if (cache)
+        abi = cache->get(key, [&](const parsed_abi& a) { return a.raw.size() == size && !memcmp(a.raw.data(), raw.pos, size); });
+    if (!abi) {
+        abi = parse_abi(raw);
+        // the parsed form is several times larger than the raw ABI
+        if (abi && cache)
+            cache->put(std::move(key), abi, abi->raw.size() * 8);
+    }
+    return abi;
+}
+
+// The current thread's contract for abi, filled on first use
+abieos::contract& thread_contract(::state& state, const std::shared_ptr<const parsed_abi>& abi) {
+    auto it = state.contracts.find(abi.get());
+    if (it != state.contracts.end())
+        return it->second.contract;
+    if (state.contracts.size() >= ::state::max_contracts)
+        state.contracts.clear();
+    auto&       entry = state.contracts[abi.get()];
+    std::string error;
+    entry.abi = abi;
+    if (!abieos::fill_contract(entry.contract, error, abi->def)) {
+        state.contracts.erase(abi.get());
+        throw std::runtime_error("invalid abi: " + error);
+    }
+    return entry.contract;
+}
+
+// Returns false if the ABI has no type for the table or the row doesn't match it
+bool table_to_json(::state& state, const std::shared_ptr<const parsed_abi>& abi, name table, input_buffer row, std::string& json) {
+    for (auto& table_def : abi->def.tables) {
+        if (table_def.name == table) {
+            auto& contract = thread_contract(state, abi);
+            auto  it       = contract.abi_types.find(table_def.type);
+            if (it != contract.abi_types.end()) {
+                std::string error;
+                return bin_to_json(row, error, &it->second, json);
+            }
+        }
+    }
+    return false;
+}
+
+// args: ArrayBuffer, begin, end; the buffer holds account, uint32 block_index, then the raw ABI
+// returns: handle, or 0 if the ABI is invalid
+bool abi_prepare(JSContext* cx, unsigned argc, JS::Value* vp) {
+    auto&        state = ::state::from_context(cx);
+    JS::CallArgs args  = CallArgsFromVp(argc, vp);
+    if (!args.requireAtLeast(cx, "abi_prepare", 3))
+        return false;
+    std::shared_ptr<const parsed_abi> abi;
+    std::string                       error;
+    {
+        JS::AutoCheckCannotGC checkGC;
+        auto                  buf = get_input_buffer(args, 0, 1, 2, checkGC);
+        try {
+            if (!buf.pos)
+                throw std::runtime_error("invalid args");
+            auto account     = bin_to_native<name>(buf);
+            auto block_index = bin_to_native<uint32_t>(buf);
+            abi              = prepare_abi(state, account, block_index, buf);
+        } catch (const std::exception& e) {
+            error = e.what();
+        } catch (...) {
+            error = "error";
+        }
+    }
+    if (!js_assert(error.empty(), cx, ("abi_prepare: " + error).c_str()))
+        return false;
+    if (!abi) {
+        args.rval().setInt32(0);
+        return true;
+    }
+    state.abis.push_back(std::move(abi));
+    args.rval().setNumber(uint32_t(state.abis.size()));
+    return true;
+} // abi_prepare
+
+// args: ArrayBuffer, begin, end, abi handle, callback; the buffer holds the table name, then the row
+// returns: table_to_json's result
+bool abi_table_to_json(JSContext* cx, unsigned argc, JS::Value* vp) {
+    auto&        state = ::state::from_context(cx);
+    JS::CallArgs args  = CallArgsFromVp(argc, vp);
+    if (!args.requireAtLeast(cx, "abi_table_to_json", 5))
+        return false;
+    if (!js_assert(args[3].isNumber(), cx, "abi_table_to_json: invalid args"))
+        return false;
+    auto handle = (uint32_t)args[3].toNumber();
+    if (!js_assert(handle && handle <= state.abis.size(), cx, "abi_table_to_json: invalid abi handle"))
+        return false;
+    auto&       abi = state.abis[handle - 1];
+    bool        ok  = false;
+    std::string json;
+    std::string error;
+    {
+        JS::AutoCheckCannotGC checkGC;
+        auto                  buf = get_input_buffer(args, 0, 1, 2, checkGC);
+        try {
+            if (!buf.pos)
+                throw std::runtime_error("invalid args");
+            auto table = bin_to_native<name>(buf);
+            ok         = table_to_json(state, abi, table, buf, json);
+        } catch (const std::exception& e) {
+            error = e.what();
+        } catch (...) {
+            error = "error";
+        }
+    }
+    if (!js_assert(error.empty(), cx, ("abi_table_to_json: " + error).c_str()))
+        return false;
+    if (ok) {
+        if (!js_assert(json.size() <= INT32_MAX, cx, "abi_table_to_json: result is too big"))
+            return false;
+        auto data = get_mem_from_callback(cx, args, 4, json.size());
+        if (!js_assert(data, cx, "abi_table_to_json: failed to fetch buffer from callback"))
+            return false;
+        memcpy(data, json.data(), json.size());
+    }
+    args.rval().setBoolean(ok);
+    return true;
+} // abi_table_to_json
+
+// Lets glue.js mark phases inside the wasm call. Does nothing unless the request is traced.
+// args: name
+bool trace_begin(JSContext* cx, unsigned argc, JS::Value* vp) {
+    auto&        state = ::state::from_context(cx);
+    JS::CallArgs args  = CallArgsFromVp(argc, vp);
+    if (!state.trace)
+        return true;
+    std::string name;
+    if (!js_assert(args.length() >= 1 && args[0].isString() && convert_str(cx, args[0].toString(), name), cx, "trace_begin: invalid args"))
+        return false;
+    try {
+        state.js_spans.push_back(state.trace->begin(std::move(name), "js"));
+        return true;
+    } catch (...) {
+        return js_assert(false, cx, "trace_begin error");
+    }
+}
+
+bool trace_end(JSContext* cx, unsigned argc, JS::Value* vp) {
+    auto& state = ::state::from_context(cx);
+    if (state.trace && !state.js_spans.empty()) {
+        state.trace->end(state.js_spans.back());
+        state.js_spans.pop_back();
+    }
+    return true;
+}
+
+static const JSFunctionSpec functions[] = {
+    JS_FN("abi_prepare", abi_prepare, 0, 0),               //
+    JS_FN("abi_table_to_json", abi_table_to_json, 0, 0),   //
+    JS_FN("append_output_data", append_output_data, 0, 0), //
+    JS_FN("exec_query", exec_query, 0, 0),                 //
+    JS_FN("get_context_data", get_context_data, 0, 0),     //
+    JS_FN("get_input_data", get_input_data, 0, 0),         //
+    JS_FN("get_wasm_module", get_wasm_module, 0, 0),       //
+    JS_FN("print_js_str", print_js_str, 0, 0),             //
+    JS_FN("print_wasm_str", print_wasm_str, 0, 0),         //
+    JS_FN("query_close", query_close, 0, 0),               //
+    JS_FN("query_next", query_next, 0, 0),                 //
+    JS_FN("query_open", query_open, 0, 0),                 //
+    JS_FN("set_output_data", set_output_data, 0, 0),       //
+    JS_FN("trace_begin", trace_begin, 0, 0),               //
+    JS_FN("trace_end", trace_end, 0, 0),                   //
+    JS_FS_END                                              //
+};
+
+// One prepared statement per query, named after the query. Postgres infers the parameter types
+// from the function's signature.
+void prepare_queries(pg::connection& conn, const shared_state& shared) {
+    for (auto& query : shared.config.queries)
+        conn.prepare((std::string)query.wasm_name, query_sql(shared.schema, query));
+}
+
+void init_glue(::state& state) {
+    create_global(state, functions);
+    execute(state, "glue.js", read_string("../src/glue.js"));
+}
+
+// Compiles every *-server.wasm in the working directory into module_cache, unless the same version is
+// already there
+void precompile_wasms(::state& state) {
+    static const std::string suffix = "-server.wasm";
+    JSAutoRealm              realm(state.context.cx, state.global);
+    for (auto& entry : boost::filesystem::directory_iterator(".")) {
+        auto filename = entry.path().filename().string();
+        if (filename.size() <= suffix.size() || filename.compare(filename.size() - suffix.size(), suffix.size(), suffix))
+            continue;
+        auto start = std::chrono::steady_clock::now();
+        if (!load_wasm_module(state, filename.substr(0, filename.size() - suffix.size()), true)) {
+            JS_ClearPendingException(state.context.cx);
+            throw std::runtime_error("compiling " + filename + " failed");
+        }
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+        ilog("loaded ${f} in ${ms} ms", ("f", filename)("ms", ms));
+    }
+}
+
+// Compiles what changed on disk, then switches new requests over to it. Requests which are already
+// running finish on the modules they started with. Cached responses may have come from the old
+// code, so they are dropped; those requests tagged theirs with the old generation, so they won't be
+// stored or served once they finish.
+std::vector<char> reload_wasms(::state& state) {
+    precompile_wasms(state);
+    auto generation = ++state.shared->module_cache->generation;
+    if (state.shared->response_cache)
+        state.shared->response_cache->erase_if([](const cached_response&) { return true; });
+    ilog("reloaded wasms; generation ${g}", ("g", generation));
+    auto json = "{\"generation\":" + std::to_string(generation) + "}\n";
+    return {json.begin(), json.end()};
+}
+
+// Every query in the request sees one snapshot. fill_status comes from the listener's cache and is
+// read before the transaction starts, so the snapshot is at least as new as it. If a fork lands
+// between the two, head_id may briefly describe the block which was replaced.
+void begin_snapshot(::state& state) {
+    {
+        tracing::scoped_span span{state.trace, "fill_status", "sql"};
+        state.fill = *state.shared->fill_status->get();
+    }
+    tracing::scoped_span span{state.trace, "begin", "sql"};
+    state.sql_connection->exec("begin isolation level repeatable read read only");
+}
+
+void fill_context_data(::state& state) {
+    state.context_data.clear();
+    abieos::native_to_bin(state.context_data, state.fill.head);
+    abieos::native_to_bin(state.context_data, state.fill.head_id);
+    abieos::native_to_bin(state.context_data, state.fill.irreversible);
+    abieos::native_to_bin(state.context_data, state.fill.irreversible_id);
+    abieos::native_to_bin(state.context_data, state.fill.first);
+}
+
+// Holds a pooled connection for the duration of a request
+struct sql_scope {
+    ::state&        state;
+    pg::pool::lease lease;
+
+    sql_scope(::state& state)
+        : sql_scope(state, state.shared->sql_pool->checkout()) {}
+
+    sql_scope(::state& state, pg::pool::lease lease)
+        : state(state)
+        , lease(std::move(lease)) {
+        state.sql_connection = &*this->lease;
+        state.sql_timeout.reset();
+    }
+
+    ~sql_scope() { state.sql_connection = nullptr; }
+};
+
+template <typename F>
+void snapshot_request(::state& state, F f) {
+    sql_scope sql{state};
+    begin_snapshot(state);
+    fill_context_data(state);
+    state.clear_depends_on_head();
+    f();
+    state.sql_connection->exec("commit");
+}
+
+using flush_fn = std::function<void(const std::vector<char>&)>;
+
+// Points set_output_data and append_output_data at out for the duration of a call into the wasm
+struct output_scope {
+    ::state& state;
+
+    output_scope(::state& state, std::vector<char>& out, bool sized, flush_fn flush = {})
+        : state(state) {
+        state.output          = &out;
+        state.output_begin    = out.size();
+        state.output_sized    = sized;
+        state.output_appended = false;
+        state.flush_output    = std::move(flush);
+    }
+
+    ~output_scope() {
+        state.output       = nullptr;
+        state.flush_output = nullptr;
+    }
+};
+
+// Releases what a wasm call acquired. Closes the cursors it left open, so sub-requests sharing a
+// transaction don't accumulate them.
+struct call_scope {
+    ::state& state;
+
+    ~call_scope() {
+        for (auto& [cursor, c] : state.cursors) {
+            if (!c.declared)
+                continue;
+            try {
+                state.sql_connection->exec("close " + cursor_name(cursor));
+            } catch (...) {
+            }
+        }
+        state.cursors.clear();
+        state.abis.clear();
+    }
+};
 
-    static state& from_context(JSContext* cx) { return *reinterpret_cast<state*>(JS_GetContextPrivate(cx)); }
+// Arms the watchdog for the duration of a call into the wasm
+struct deadline_scope {
+    ::state& state;
+    bool     armed = false;
+
+    deadline_scope(::state& state, std::chrono::milliseconds timeout)
+        : state(state) {
+        state.timed_out = false;
+        if (timeout.count()) {
+            state.shared->watchdog->arm(&state, watchdog::clock::now() + timeout);
+            armed = true;
+        }
+    }
+
+    ~deadline_scope() {
+        if (armed)
+            state.shared->watchdog->disarm(&state);
+    }
 };
 
-// args: wasm_name
-bool get_wasm(JSContext* cx, unsigned argc, JS::Value* vp) {
-    JS::CallArgs args = CallArgsFromVp(argc, vp);
-    if (!args.requireAtLeast(cx, "get_wasm", 1))
-        return false;
-    std::string wasm_name;
-    if (!js_assert(args[0].isString() && convert_str(cx, args[0].toString(), wasm_name), cx, "get_wasm: invalid args"))
-        return false;
+// Stops the deadline's clock while the worker does something which isn't the wasm's time to spend
+struct deadline_pause {
+    ::state&                                 state;
+    std::optional<watchdog::clock::duration> remaining;
 
-    // todo: sanitize wasm_name
-    wasm_name += "-server.wasm";
+    deadline_pause(::state& state)
+        : state(state)
+        , remaining(state.shared->watchdog->pause(&state)) {}
 
-    try {
-        std::fstream file(wasm_name, std::ios_base::in | std::ios_base::binary);
-        file.seekg(0, std::ios_base::end);
-        auto len = file.tellg();
-        if (len <= 0)
-            return js_assert(false, cx, ("can not read " + wasm_name).c_str());
-        file.seekg(0, std::ios_base::beg);
-        auto data = malloc(len);
-        if (!data)
-            return js_assert(false, cx, ("out of memory reading " + wasm_name).c_str());
-        file.read(reinterpret_cast<char*>(data), len);
-        JS::CallArgs args = CallArgsFromVp(argc, vp);
-        args.rval().setObjectOrNull(JS_NewArrayBufferWithContents(cx, len, data));
-        return true;
-    } catch (...) {
-        return js_assert(false, cx, ("error reading " + wasm_name).c_str());
+    ~deadline_pause() {
+        if (remaining)
+            state.shared->watchdog->arm(&state, watchdog::clock::now() + *remaining);
     }
+};
+
+// Sub-requests of a batch share a transaction, so statement_timeout only changes when the wasm does
+void set_sql_timeout(::state& state, std::chrono::milliseconds timeout) {
+    if (state.sql_timeout == timeout.count())
+        return;
+    state.sql_connection->exec("set local statement_timeout = " + std::to_string(timeout.count()));
+    state.sql_timeout = timeout.count();
 }
 
-// args: ArrayBuffer, row_request_begin, row_request_end, callback
-bool exec_query(JSContext* cx, unsigned argc, JS::Value* vp) {
-    auto&        state = ::state::from_context(cx);
-    JS::CallArgs args  = CallArgsFromVp(argc, vp);
-    if (!args.requireAtLeast(cx, "exec_query", 4))
-        return false;
-    std::vector<char> args_bin;
-    bool              ok = true;
-    {
-        JS::AutoCheckCannotGC checkGC;
-        auto                  b = get_input_buffer(args, 0, 1, 2, checkGC);
-        if (b.pos) {
-            try {
-                args_bin.assign(b.pos, b.end);
-            } catch (...) {
-                ok = false;
+void call_query(::state& state, const std::string& wasm_name) {
+    auto& limits = state.shared->get_limits(wasm_name);
+    set_sql_timeout(state, limits.sql_timeout);
+
+    call_scope            scope{state};
+    JSAutoRealm           realm(state.context.cx, state.global);
+    JS::RootedValue       rval(state.context.cx);
+    JS::AutoValueArray<3> args(state.context.cx);
+    args[0].set(JS::StringValue(JS_NewStringCopyZ(state.context.cx, wasm_name.c_str())));
+    args[1].set(JS::NumberValue(limits.max_memory));
+    args[2].set(JS::NumberValue(state.shared->module_cache->generation));
+    deadline_scope       deadline{state, limits.timeout};
+    tracing::scoped_span span{state.trace, "call", "wasm", "\"wasm\":\"" + tracing::json_escape(wasm_name) + "\""};
+    auto&                m       = *state.shared->metrics;
+    auto                 start   = metrics::clock::now();
+    auto                 db_time = state.db_time;
+    bool                 ok      = JS_CallFunctionName(state.context.cx, state.global, "query", args, &rval);
+    auto                 elapsed = metrics::clock::now() - start;
+    m.wasm_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed - (state.db_time - db_time)).count();
+    if (ok) {
+        m.wasm_call.get(wasm_name).observe(elapsed); // only names which loaded, so the label set stays bounded
+        return;
+    }
+    // todo: detect assert
+    JS_ClearPendingException(state.context.cx);
+    if (state.timed_out)
+        throw std::runtime_error(wasm_name + " timed out");
+    throw std::runtime_error("JS_CallFunctionName failed");
+}
+
+// Appends the reply to out, prefixed with its size
+void run_query(::state& state, input_buffer request, std::vector<char>& out) {
+    state.request_prefix.clear();
+    state.request = request;
+    auto ns_name  = bin_to_native<name>(state.request);
+    if (ns_name != "local"_n)
+        throw std::runtime_error("unknown namespace: " + (std::string)ns_name);
+    auto wasm_name = bin_to_native<name>(state.request);
+
+    output_scope output{state, out, true};
+    call_query(state, (std::string)wasm_name);
+    finish_output(state);
+}
+
+// The sub-requests of a batch are independent, so idle workers help run them. Helpers import the
+// coordinator's snapshot and only join if a pooled connection is ready without any I/O. The
+// coordinator runs sub-requests too, so the batch completes even when no worker helps.
+struct query_batch {
+    std::vector<input_buffer>      requests        = {};
+    std::vector<std::vector<char>> replies         = {}; // each prefixed with its size
+    ::fill_status                  fill            = {};
+    std::string                    snapshot        = {};
+    std::atomic<uint32_t>          next            = 0;
+    std::atomic<bool>              failed          = false;
+    std::atomic<bool>              depends_on_head = false;
+    std::mutex                     mutex;
+    std::condition_variable        cv;
+    uint32_t                       num_done        = 0;
+    std::exception_ptr             error           = {};
+
+    bool has_work() const { return next < requests.size(); }
+
+    // Every sub-request gets claimed and counted as done, even the ones skipped after a failure
+    void run(::state& state) {
+        while (true) {
+            uint32_t i = next++;
+            if (i >= requests.size())
+                return;
+            if (!failed) {
+                try {
+                    run_query(state, requests[i], replies[i]);
+                } catch (...) {
+                    std::lock_guard lock{mutex};
+                    if (!error)
+                        error = std::current_exception();
+                    failed = true;
+                }
             }
+            std::lock_guard lock{mutex};
+            ++num_done;
+            cv.notify_all();
         }
     }
-    if (!ok)
-        return js_assert(false, cx, "exec_query: invalid args");
 
-    try {
-        abieos::input_buffer args_buf{args_bin.data(), args_bin.data() + args_bin.size()};
-        abieos::name         query_name;
-        abieos::bin_to_native(query_name, args_buf);
-
-        auto it = state.config.query_map.find(query_name);
-        if (it == state.config.query_map.end())
-            return js_assert(false, cx, ("exec_query: unknown query: " + (std::string)query_name).c_str());
-        query_config::query& query = *it->second;
-
-        uint32_t max_block_index = 0;
-        if (query.limit_block_index)
-            max_block_index = std::min(state.head, abieos::bin_to_native<uint32_t>(args_buf));
-        std::string query_str = "select * from \"" + state.schema + "\"." + query.function + "(";
-        bool        need_sep  = false;
-        if (query.limit_block_index) {
-            query_str += sql_conversion::sql_str(max_block_index);
-            need_sep = true;
-        }
-        auto add_args = [&](auto& args) {
-            for (auto& arg : args) {
-                if (need_sep)
-                    query_str += query_config::sep;
-                query_str += arg.bin_to_sql(args_buf);
-                need_sep = true;
-            }
-        };
-        add_args(query.arg_types);
-        add_args(query.range_types);
-        add_args(query.range_types);
-        auto max_results = abieos::read_raw<uint32_t>(args_buf);
-        query_str += query_config::sep + sql_conversion::sql_str(std::min(max_results, query.max_results));
-        query_str += ")";
-        // std::cerr << query_str << "\n";
-
-        pqxx::work        t(state.sql_connection);
-        auto              exec_result = t.exec(query_str);
-        std::vector<char> result_bin;
-        std::vector<char> row_bin;
-        push_varuint32(result_bin, exec_result.size());
-        for (const auto& r : exec_result) {
-            row_bin.clear();
-            int i = 0;
-            for (auto& type : query.result_types)
-                type.sql_to_bin(row_bin, r[i++]);
-            if (!js_assert((uint32_t)row_bin.size() == row_bin.size(), cx, "exec_query: row is too big"))
-                return false;
-            push_varuint32(result_bin, row_bin.size());
-            result_bin.insert(result_bin.end(), row_bin.begin(), row_bin.end());
+    void help(::state& state) {
+        if (!has_work())
+            return;
+        auto lease = state.shared->sql_pool->try_checkout();
+        if (!lease)
+            return;
+        sql_scope sql{state, std::move(*lease)};
+        try {
+            // fails if the coordinator already committed, in which case there's nothing left to do
+            state.sql_connection->exec_script(
+                "begin isolation level repeatable read read only; set transaction snapshot '" + snapshot + "'");
+        } catch (...) {
+            return;
+        }
+        state.fill = fill;
+        fill_context_data(state);
+        state.clear_depends_on_head();
+        run(state);
+        if (state.depends_on_head())
+            depends_on_head = true;
+        state.sql_connection->exec("commit");
+    }
+
+    void wait() {
+        std::unique_lock lock{mutex};
+        cv.wait(lock, [&] { return num_done == requests.size(); });
+        if (error)
+            std::rethrow_exception(error);
+    }
+}; // query_batch
+
+std::shared_ptr<const cached_response> find_response(::state& state, const std::string& key) {
+    auto fill       = state.shared->fill_status->get();
+    auto generation = state.shared->module_cache->generation.load();
+    return state.shared->response_cache->get(key, [&](const cached_response& r) { return r.valid(fill->head_id, generation); });
+}
+
+// generation is module_cache's as of the start of the request. If a reload happened since, the
+// reply may have come from the old code, so it isn't stored.
+void store_response(::state& state, std::string key, const std::vector<char>& body, bool depends_on_head, uint32_t generation) {
+    if (generation != state.shared->module_cache->generation)
+        return;
+    auto r             = std::make_shared<cached_response>();
+    r->body            = body;
+    r->depends_on_head = depends_on_head;
+    r->head_id         = state.fill.head_id;
+    r->generation      = generation;
+    state.shared->response_cache->put(std::move(key), std::move(r), body.size());
+}
+
+// The sub-requests point into request, which must outlive the call. Without helpers, each reply is
+// written straight into the result.
+std::vector<char> query(::state& state, const std::vector<char>& request) {
+    auto        generation = state.shared->module_cache->generation.load();
+    std::string cache_key;
+    if (state.shared->response_cache) {
+        cache_key = "q" + std::string(request.begin(), request.end());
+        if (auto r = find_response(state, cache_key))
+            return r->body;
+    }
+
+    auto         batch = std::make_shared<query_batch>();
+    input_buffer request_bin{request.data(), request.data() + request.size()};
+    auto         num_requests = bin_to_native<varuint32>(request_bin).value;
+    for (uint32_t request_index = 0; request_index < num_requests; ++request_index)
+        batch->requests.push_back(bin_to_native<input_buffer>(request_bin));
+
+    std::vector<char> result;
+    bool              depends_on_head = false;
+    push_varuint32(result, num_requests);
+    snapshot_request(state, [&] {
+        uint32_t num_helpers = num_requests > 1 ? std::min<uint32_t>(num_requests, state.shared->num_threads) - 1 : 0;
+        if (!num_helpers) {
+            for (auto& r : batch->requests)
+                run_query(state, r, result);
+            depends_on_head = state.depends_on_head();
+            return;
         }
-        t.commit();
-        if (!js_assert((uint32_t)result_bin.size() == result_bin.size(), cx, "exec_query: result is too big"))
+        batch->replies.resize(num_requests);
+        batch->fill     = state.fill;
+        batch->snapshot = state.sql_connection->exec("select pg_export_snapshot()").get(0, 0).data;
+        for (uint32_t i = 0; i < num_helpers; ++i)
+            asio::post(*state.shared->workers, [batch] { catch_and_log([&] { batch->help(*thread_state); }); });
+        batch->run(state);
+        batch->wait();
+        depends_on_head = state.depends_on_head() || batch->depends_on_head;
+
+        size_t size = result.size();
+        for (auto& reply : batch->replies)
+            size += reply.size();
+        result.reserve(size);
+        for (auto& reply : batch->replies)
+            result.insert(result.end(), reply.begin(), reply.end());
+    });
+    if (state.shared->response_cache)
+        store_response(state, std::move(cache_key), result, depends_on_head, generation);
+    return result;
+}
+
+// The host's copy of the legacy wasm's get_table_rows. It covers the same shapes (primary and
+// i64/name secondary indexes) and produces the same bytes. Where the wasm would fail, the request is
+// left to the wasm, so errors don't change either.
+struct get_table_rows_params {
+    bool             json           = false;
+    name             code           = {};
+    std::string_view scope          = {};
+    name             table          = {};
+    std::string_view lower_bound    = {};
+    std::string_view upper_bound    = {};
+    uint32_t         limit          = 10;
+    std::string_view key_type       = {};
+    std::string_view index_position = {};
+    bool             show_payer     = false;
+};
+
+// Reads json the way lib-parse-json.hpp does, quirks included. Each read returns false where the wasm
+// would assert.
+struct legacy_json_reader {
+    const char* pos;
+    const char* end;
+
+    void skip_space() {
+        while (pos != end && (*pos == 0x09 || *pos == 0x0a || *pos == 0x0d || *pos == 0x20))
+            ++pos;
+    }
+
+    void skip_value() {
+        while (pos != end && *pos != ',' && *pos != '}')
+            ++pos;
+    }
+
+    bool expect(char ch) {
+        if (pos == end || *pos != ch)
             return false;
-        auto data = get_mem_from_callback(cx, args, 3, result_bin.size());
-        if (!js_assert(data, cx, "exec_query: failed to fetch buffer from callback"))
+        ++pos;
+        skip_space();
+        return true;
+    }
+
+    // no escapes
+    bool read(std::string_view& result) {
+        if (pos == end || *pos++ != '"')
+            return false;
+        auto begin = pos;
+        while (pos != end && *pos != '"')
+            ++pos;
+        if (pos == end)
             return false;
-        memcpy(data, result_bin.data(), result_bin.size());
+        result = std::string_view(begin, pos++ - begin);
         return true;
-    } catch (const std::exception& e) {
-        return js_assert(false, cx, ("exec_query: "s + e.what()).c_str());
-    } catch (...) {
-        return js_assert(false, cx, "exec_query error");
     }
-} // exec_query
 
-static const JSFunctionSpec functions[] = {
-    JS_FN("exec_query", exec_query, 0, 0),             //
-    JS_FN("get_context_data", get_context_data, 0, 0), //
-    JS_FN("get_input_data", get_input_data, 0, 0),     //
-    JS_FN("get_wasm", get_wasm, 0, 0),                 //
-    JS_FN("print_js_str", print_js_str, 0, 0),         //
-    JS_FN("print_wasm_str", print_wasm_str, 0, 0),     //
-    JS_FN("set_output_data", set_output_data, 0, 0),   //
-    JS_FS_END                                          //
+    // the wasm doesn't accept quoted numbers, although it tries to
+    bool read(uint32_t& result) {
+        bool found = false;
+        result     = 0;
+        while (pos != end && *pos >= '0' && *pos <= '9') {
+            result = result * 10 + *pos++ - '0';
+            found  = true;
+        }
+        skip_space();
+        return found;
+    }
+
+    bool read(bool& result) {
+        if (end - pos >= 4 && !strncmp(pos, "true", 4)) {
+            pos += 4;
+            result = true;
+        } else if (end - pos >= 5 && !strncmp(pos, "false", 5)) {
+            pos += 5;
+            result = false;
+        } else {
+            return false;
+        }
+        skip_space();
+        return true;
+    }
+
+    bool read(name& result) {
+        std::string_view s;
+        return read(s) && legacy_name(s, result);
+    }
+
+    // eosio::name's constructor, which rejects characters that abieos::string_to_name would map to 0
+    static bool legacy_name(std::string_view s, name& result) {
+        auto char_to_value = [](char c) -> int {
+            if (c == '.')
+                return 0;
+            if (c >= '1' && c <= '5')
+                return c - '1' + 1;
+            if (c >= 'a' && c <= 'z')
+                return c - 'a' + 6;
+            return -1;
+        };
+        if (s.size() > 13)
+            return false;
+        result = name{};
+        if (s.empty())
+            return true;
+        auto n = std::min(s.size(), size_t(12));
+        for (size_t i = 0; i < n; ++i) {
+            auto v = char_to_value(s[i]);
+            if (v < 0)
+                return false;
+            result.value = (result.value << 5) | v;
+        }
+        result.value <<= 4 + 5 * (12 - n);
+        if (s.size() == 13) {
+            auto v = char_to_value(s[12]);
+            if (v < 0 || v > 0x0f)
+                return false;
+            result.value |= v;
+        }
+        return true;
+    }
 };
 
-void init_glue(::state& state) {
-    create_global(state, functions);
-    execute(state, "glue.js", read_string("../src/glue.js"));
+bool parse_get_table_rows_params(std::string_view json, get_table_rows_params& params) {
+    legacy_json_reader r{json.data(), json.data() + json.size()};
+    r.skip_space();
+    if (!r.expect('{'))
+        return false;
+    if (r.pos != r.end && *r.pos != '}') {
+        while (true) {
+            std::string_view key;
+            if (!r.read(key) || !r.expect(':'))
+                return false;
+            bool ok = true;
+            if (key == "json")
+                ok = r.read(params.json);
+            else if (key == "code")
+                ok = r.read(params.code);
+            else if (key == "scope")
+                ok = r.read(params.scope);
+            else if (key == "table")
+                ok = r.read(params.table);
+            else if (key == "lower_bound")
+                ok = r.read(params.lower_bound);
+            else if (key == "upper_bound")
+                ok = r.read(params.upper_bound);
+            else if (key == "limit")
+                ok = r.read(params.limit);
+            else if (key == "key_type")
+                ok = r.read(params.key_type);
+            else if (key == "index_position")
+                ok = r.read(params.index_position);
+            else if (key == "show_payer")
+                ok = r.read(params.show_payer);
+            else
+                r.skip_value();
+            if (!ok)
+                return false;
+            if (r.pos != r.end && *r.pos == ',') {
+                ++r.pos;
+                r.skip_space();
+            } else
+                break;
+        }
+    }
+    return r.expect('}') && r.pos == r.end;
 }
 
-void fetch_fill_status(::state& state) {
-    pqxx::work t(state.sql_connection);
-    auto       row = t.exec("select head, head_id, irreversible, irreversible_id, first from \"" + state.schema + "\".fill_status")[0];
-
-    state.head            = row[0].as<uint32_t>();
-    state.head_id         = query_config::sql_to_checksum256(row[1].c_str());
-    state.irreversible    = row[2].as<uint32_t>();
-    state.irreversible_id = query_config::sql_to_checksum256(row[3].c_str());
-    state.first           = row[4].as<uint32_t>();
+// The wasm's starts_with compares the prefix's terminating null too
+template <int size>
+bool legacy_starts_with(std::string_view s, const char (&prefix)[size]) {
+    return s.size() >= size && !strncmp(s.data(), prefix, size);
 }
 
-void fill_context_data(::state& state) {
-    state.context_data.clear();
-    abieos::native_to_bin(state.context_data, state.head);
-    abieos::native_to_bin(state.context_data, state.head_id);
-    abieos::native_to_bin(state.context_data, state.irreversible);
-    abieos::native_to_bin(state.context_data, state.irreversible_id);
-    abieos::native_to_bin(state.context_data, state.first);
-}
-
-// todo: detect state.first changing (history trim)
-bool did_fork(::state& state) {
-    pqxx::work t(state.sql_connection);
-    auto result = t.exec("select block_id from \"" + state.schema + "\".block_info where block_index=" + query_config::sql_str(state.head));
-    if (result.empty()) {
-        ilog("fork detected (prev head not found)");
+// Follows get_table_index_name. The wasm queries the table itself whichever secondary index is
+// named, so only primary vs. secondary matters.
+bool get_table_index_kind(const get_table_rows_params& params, bool& primary) {
+    if (params.table.value & 0xF)
+        return false;
+    auto p  = params.index_position;
+    primary = false;
+    if (p.empty() || p == "first" || p == "primary" || p == "one") {
+        primary = true;
         return true;
     }
-    auto id = query_config::sql_to_checksum256(result[0][0].c_str());
-    if (id.value != state.head_id.value) {
-        ilog("fork detected (head_id changed)");
+    if (legacy_starts_with(p, "sec") || p == "two" || legacy_starts_with(p, "ter") || legacy_starts_with(p, "th") ||
+        legacy_starts_with(p, "fou") || legacy_starts_with(p, "fi") || legacy_starts_with(p, "six") || legacy_starts_with(p, "sev") ||
+        legacy_starts_with(p, "eig") || legacy_starts_with(p, "nin") || legacy_starts_with(p, "ten"))
+        return true;
+    uint64_t    pos = 0;
+    std::string error;
+    if (!abieos::decimal_to_binary(pos, error, p))
+        return false;
+    primary = pos < 2;
+    return true;
+}
+
+bool guess_uint64(std::string_view str, uint64_t& result) {
+    std::string error;
+    if (abieos::decimal_to_binary(result, error, str))
+        return true;
+    while (!str.empty() && str.front() == ' ')
+        str.remove_prefix(1);
+    while (!str.empty() && str.back() == ' ')
+        str.remove_suffix(1);
+    return abieos::string_to_name_strict(str, result) ||
+           (str.find(',') != std::string_view::npos && abieos::string_to_symbol(result, error, str)) ||
+           abieos::string_to_symbol_code(result, error, str);
+}
+
+// Leaves result alone if key is empty
+bool convert_key(std::string_view key_type, std::string_view key, uint64_t& result) {
+    if (key.empty())
+        return true;
+    if (key_type == "name") {
+        name n;
+        if (!legacy_json_reader::legacy_name(key, n))
+            return false;
+        result = n.value;
         return true;
     }
-    return false;
+    std::string error;
+    return abieos::decimal_to_binary(result, error, key);
+}
+
+// Runs a query through the same path as exec_query. req holds what the wasm would pack.
+std::shared_ptr<const std::vector<char>> exec_native_query(::state& state, const std::vector<char>& req) {
+    query_args qa;
+    decode_query_args(state, input_buffer{req.data(), req.data() + req.size()}, qa);
+    return exec_query_args(state, qa);
 }
 
 template <typename F>
-void retry_loop(::state& state, F f) {
-    int num_tries = 0;
-    while (true) {
-        fetch_fill_status(state);
-        fill_context_data(state);
-        if (f())
-            return;
-        if (++num_tries >= 4)
-            throw std::runtime_error("too many fork events during request");
-        ilog("retry request");
+void for_each_result_row(const std::vector<char>& result_bin, F f) {
+    input_buffer buf{result_bin.data(), result_bin.data() + result_bin.size()};
+    auto         num_rows = bin_to_native<varuint32>(buf).value;
+    for (uint32_t i = 0; i < num_rows; ++i) {
+        auto row = bin_to_native<input_buffer>(buf);
+        f(row);
     }
 }
 
-std::vector<char> query(::state& state, const std::vector<char>& request) {
-    std::vector<char> result;
-    retry_loop(state, [&] {
-        input_buffer request_bin{request.data(), request.data() + request.size()};
-        auto         num_requests = bin_to_native<varuint32>(request_bin).value;
-        result.clear();
-        push_varuint32(result, num_requests);
-        for (uint32_t request_index = 0; request_index < num_requests; ++request_index) {
-            state.request = bin_to_native<input_buffer>(request_bin);
-            auto ns_name  = bin_to_native<name>(state.request);
-            if (ns_name != "local"_n)
-                throw std::runtime_error("unknown namespace: " + (std::string)ns_name);
-            auto wasm_name = bin_to_native<name>(state.request);
-
-            JSAutoRealm           realm(state.context.cx, state.global);
-            JS::RootedValue       rval(state.context.cx);
-            JS::AutoValueArray<1> args(state.context.cx);
-            args[0].set(JS::StringValue(JS_NewStringCopyZ(state.context.cx, ((std::string)wasm_name).c_str())));
-            if (!JS_CallFunctionName(state.context.cx, state.global, "query", args, &rval)) {
-                // todo: detect assert
-                JS_ClearPendingException(state.context.cx);
-                throw std::runtime_error("JS_CallFunctionName failed");
-            }
+// Follows get_abi: the account row as of head, if it has an ABI
+std::shared_ptr<const parsed_abi> get_legacy_abi(::state& state, name account) {
+    std::vector<char> req;
+    native_to_bin(req, "account"_n);
+    native_to_bin(req, state.fill.head);
+    native_to_bin(req, account);
+    native_to_bin(req, account);
+    native_to_bin(req, uint32_t(1));
+    std::shared_ptr<const parsed_abi> abi;
+    for_each_result_row(*exec_native_query(state, req), [&](input_buffer row) {
+        auto block_index = read_raw<uint32_t>(row);
+        auto present     = read_raw<bool>(row);
+        auto row_account = bin_to_native<name>(row);
+        row.pos += 1 + 1 + 1 + 8 + 32 + 4; // vm_type, vm_version, privileged, last_code_update, code_version, creation_date
+        if (row.pos > row.end)
+            throw std::runtime_error("invalid account row");
+        bin_to_native<input_buffer>(row); // code
+        auto raw = bin_to_native<input_buffer>(row);
+        if (present && raw.pos != raw.end)
+            abi = prepare_abi(state, row_account, block_index, raw);
+    });
+    return abi;
+}
 
-            if (did_fork(state))
-                return false;
+// Appends one element of the rows array
+void append_table_row(
+    ::state& state, std::vector<char>& out, const get_table_rows_params& params, const std::shared_ptr<const parsed_abi>& abi,
+    input_buffer value, name payer, bool& found) {
+    std::string result;
+    if (found)
+        result += ',';
+    found = true;
+    if (params.show_payer)
+        result += "{\"data\":";
+    std::string json_row;
+    if (abi && table_to_json(state, abi, params.table, value, json_row)) {
+        result += json_row;
+    } else {
+        result += '"';
+        hex_codec::append(result, value.pos, value.end - value.pos);
+        result += '"';
+    }
+    if (params.show_payer)
+        result += ",\"payer\":\"" + (std::string)payer + "\"}";
+    out.insert(out.end(), result.begin(), result.end());
+}
+
+// Returns false, having written nothing, if the wasm should handle the request instead
+bool native_get_table_rows(::state& state, const std::vector<char>& request, std::vector<char>& out) {
+    tracing::scoped_span  span{state.trace, "native_get_table_rows", "http"};
+    get_table_rows_params params;
+    bool                  primary = false;
+    uint64_t              scope   = 0;
+    uint64_t              lower   = 0;
+    uint64_t              upper   = 0xffff'ffff'ffff'ffff;
+    if (!parse_get_table_rows_params(std::string_view{request.data(), request.size()}, params) ||
+        !get_table_index_kind(params, primary) || !guess_uint64(params.scope, scope) ||
+        !convert_key(params.key_type, params.lower_bound, lower) || !convert_key(params.key_type, params.upper_bound, upper))
+        return false;
+    if (!primary && params.key_type != "i64" && params.key_type != "name")
+        return false;
+
+    set_sql_timeout(state, state.shared->get_limits("legacy").sql_timeout);
+    state.read_context = true; // the wasm reads head from the context
+    auto abi           = params.json ? get_legacy_abi(state, params.code) : nullptr;
+
+    std::vector<char> req;
+    native_to_bin(req, primary ? "cr.ctsp"_n : "ci1.cts2p"_n);
+    native_to_bin(req, state.fill.head);
+    for (auto [key, pk] : {std::pair{lower, uint64_t(0)}, std::pair{upper, uint64_t(0xffff'ffff'ffff'ffff)}}) {
+        native_to_bin(req, params.code);
+        native_to_bin(req, params.table);
+        native_to_bin(req, scope);
+        native_to_bin(req, key);
+        if (!primary)
+            native_to_bin(req, pk);
+    }
+    native_to_bin(req, std::min(uint32_t(100), params.limit));
+    auto result_bin = exec_native_query(state, req);
 
-            push_varuint32(result, state.reply.size());
-            result.insert(result.end(), state.reply.begin(), state.reply.end());
+    static const auto prefix = "{\"rows\":["sv;
+    out.insert(out.end(), prefix.begin(), prefix.end());
+    bool found = false;
+    for_each_result_row(*result_bin, [&](input_buffer row) {
+        read_raw<uint32_t>(row); // block_index
+        auto present = read_raw<bool>(row);
+        row.pos += 8 + 8 + 8 + 8; // code, scope, table, primary_key
+        if (row.pos > row.end)
+            throw std::runtime_error("invalid contract row");
+        auto payer = bin_to_native<name>(row);
+        if (primary) {
+            auto value = bin_to_native<input_buffer>(row);
+            if (present)
+                append_table_row(state, out, params, abi, value, payer, found);
+        } else {
+            read_raw<uint64_t>(row); // secondary_key
+            read_raw<uint32_t>(row); // row_block_index
+            auto row_present = read_raw<bool>(row);
+            bin_to_native<name>(row); // row_payer
+            auto row_value = bin_to_native<input_buffer>(row);
+            if (present && row_present)
+                append_table_row(state, out, params, abi, row_value, payer, found);
         }
-        return true;
     });
+    static const auto suffix = "]}"sv;
+    out.insert(out.end(), suffix.begin(), suffix.end());
+    return true;
+}
+
+// The wasm sees (target, request) serialized; only the small prefix is built here and the body is
+// read in place. Output which the wasm appends may go to flush before this returns; the rest of
+// the reply is returned. Streamed replies aren't cached. native_get_table_rows may answer instead
+// of the wasm.
+std::vector<char> legacy_query(::state& state, const std::string& target, const std::vector<char>& request, flush_fn flush) {
+    auto        generation = state.shared->module_cache->generation.load();
+    std::string cache_key;
+    if (state.shared->response_cache) {
+        cache_key = "l" + target + '\0' + std::string(request.begin(), request.end());
+        if (auto r = find_response(state, cache_key))
+            return r->body;
+    }
+
+    state.request_prefix.clear();
+    abieos::native_to_bin(state.request_prefix, target);
+    push_varuint32(state.request_prefix, request.size());
+    state.request = input_buffer{request.data(), request.data() + request.size()};
+
+    std::vector<char> result;
+    bool              flushed     = false;
+    auto              flush_reply = [&](const std::vector<char>& data) {
+        // a slow client shouldn't use up the wasm's time
+        deadline_pause pause{state};
+        flushed = true;
+        flush(data);
+    };
+    snapshot_request(state, [&] {
+        if (state.shared->native_get_table_rows && target == "/v1/chain/get_table_rows" && native_get_table_rows(state, request, result))
+            return;
+        output_scope output{state, result, false, flush_reply};
+        call_query(state, "legacy");
+    });
+    if (state.shared->response_cache && !flushed)
+        store_response(state, std::move(cache_key), result, state.depends_on_head(), generation);
     return result;
 }
 
-const std::vector<char>& legacy_query(::state& state, const std::string& target, const std::vector<char>& request) {
-    std::vector<char> req;
-    abieos::native_to_bin(req, target);
-    abieos::native_to_bin(req, request);
-    state.request = input_buffer{req.data(), req.data() + req.size()};
-    retry_loop(state, [&] {
-        JSAutoRealm           realm(state.context.cx, state.global);
-        JS::RootedValue       rval(state.context.cx);
-        JS::AutoValueArray<1> args(state.context.cx);
-        args[0].set(JS::StringValue(JS_NewStringCopyZ(state.context.cx, "legacy")));
-        if (!JS_CallFunctionName(state.context.cx, state.global, "query", args, &rval)) {
-            // todo: detect assert
-            JS_ClearPendingException(state.context.cx);
-            throw std::runtime_error("JS_CallFunctionName failed");
+// Runs the warmup requests so this worker's JIT code and the modules it uses are ready before the
+// listener opens. A failure is only logged; the data a request needs may not exist yet.
+void warmup(::state& state) {
+    for (int round = 0; round < state.shared->warmup_rounds; ++round) {
+        for (auto& r : state.shared->warmup_requests) {
+            catch_and_log([&] {
+                if (r.target == "/wasmql/v1/query")
+                    query(state, r.body);
+                else
+                    legacy_query(state, r.target, r.body, [](const std::vector<char>&) {});
+            });
         }
-        return !did_fork(state);
-    });
-    return state.reply;
+    }
+}
+
+template <typename T>
+void cache_stats_to_json(std::string& json, const char* name, lru_cache<T>* cache) {
+    if (json.size() > 1)
+        json += ",";
+    json += "\""s + name + "\":{";
+    json += "\"enabled\":"s + (cache ? "true" : "false");
+    if (cache) {
+        json += ",\"entries\":" + std::to_string(cache->size());
+        json += ",\"bytes\":" + std::to_string(cache->num_bytes());
+        json += ",\"max_bytes\":" + std::to_string(cache->max_bytes);
+        json += ",\"hits\":" + std::to_string(cache->hits);
+        json += ",\"misses\":" + std::to_string(cache->misses);
+        json += ",\"evictions\":" + std::to_string(cache->evictions);
+    }
+    json += "}";
+}
+
+std::vector<char> cache_stats(const shared_state& shared) {
+    std::string json = "{";
+    cache_stats_to_json(json, "response", shared.response_cache.get());
+    cache_stats_to_json(json, "result", shared.result_cache.get());
+    cache_stats_to_json(json, "abi", shared.abi_cache.get());
+    {
+        auto& modules = *shared.module_cache;
+        json += ",\"modules\":{\"hits\":" + std::to_string(modules.hits) + ",\"compiles\":" + std::to_string(modules.compiles) + "}";
+    }
+    json += "}\n";
+    return {json.begin(), json.end()};
+}
+
+// One sample per enabled cache. Samples of a family must be contiguous, so the caller loops over
+// families.
+template <typename F>
+void cache_metrics(std::string& out, const shared_state& shared, const char* name, const char* type, const char* help, F f) {
+    metrics::write_header(out, name, type, help);
+    auto add = [&](const char* cache_name, auto* cache) {
+        if (cache)
+            out += name + "{cache=\""s + cache_name + "\"} " + std::to_string(f(*cache)) + "\n";
+    };
+    add("response", shared.response_cache.get());
+    add("result", shared.result_cache.get());
+    add("abi", shared.abi_cache.get());
+}
+
+std::vector<char> metrics_text(const shared_state& shared) {
+    auto&       m = *shared.metrics;
+    std::string out;
+    m.wasm_call.write(out);
+    m.sql.write(out);
+    m.serialize.write(out);
+
+    metrics::write_header(out, "wasm_ql_time_seconds_total", "counter", "Time spent in wasm calls, split by where it went");
+    out += "wasm_ql_time_seconds_total{part=\"wasm\"} " + std::to_string(m.wasm_ns / 1e9) + "\n";
+    out += "wasm_ql_time_seconds_total{part=\"sql\"} " + std::to_string(m.sql_ns / 1e9) + "\n";
+    out += "wasm_ql_time_seconds_total{part=\"serialize\"} " + std::to_string(m.serialize_ns / 1e9) + "\n";
+
+    metrics::write_value(out, "wasm_ql_requests_total", "counter", "HTTP requests received", m.requests.load());
+    metrics::write_value(out, "wasm_ql_errors_total", "counter", "Requests which failed", m.errors.load());
+    metrics::write_value(out, "wasm_ql_request_bytes_total", "counter", "Bytes of request bodies received", m.bytes_in.load());
+    metrics::write_value(out, "wasm_ql_response_bytes_total", "counter", "Bytes of response bodies sent", m.bytes_out.load());
+    metrics::write_value(out, "wasm_ql_connections", "gauge", "Open client connections", m.connections.load());
+
+    auto fill = shared.fill_status->get();
+    metrics::write_value(out, "wasm_ql_head_block", "gauge", "Head block as of the last poll", fill->head);
+    metrics::write_value(out, "wasm_ql_irreversible_block", "gauge", "Irreversible block as of the last poll", fill->irreversible);
+
+    metrics::write_value(out, "wasm_ql_module_hits_total", "counter", "Compiled wasm modules reused", shared.module_cache->hits.load());
+    metrics::write_value(out, "wasm_ql_module_compiles_total", "counter", "Wasm modules compiled", shared.module_cache->compiles.load());
+
+    cache_metrics(out, shared, "wasm_ql_cache_entries", "gauge", "Entries in each cache", [](auto& c) { return c.size(); });
+    cache_metrics(out, shared, "wasm_ql_cache_bytes", "gauge", "Approximate bytes in each cache", [](auto& c) { return c.num_bytes(); });
+    cache_metrics(out, shared, "wasm_ql_cache_hits_total", "counter", "Cache hits", [](auto& c) { return c.hits.load(); });
+    cache_metrics(out, shared, "wasm_ql_cache_misses_total", "counter", "Cache misses", [](auto& c) { return c.misses.load(); });
+    cache_metrics(out, shared, "wasm_ql_cache_evictions_total", "counter", "Cache evictions", [](auto& c) { return c.evictions.load(); });
+    return {out.begin(), out.end()};
 }
 
 void fail(beast::error_code ec, char const* what) { elog("${w}: ${s}", ("w", what)("s", ec.message())); }
 
-void handle_request(::state& state, tcp::socket& socket, http::request<http::vector_body<char>> req, beast::error_code& ec) {
+// Sends a response body with chunked transfer encoding while the wasm is still producing it. The
+// writes are synchronous; they run on the worker which is executing the request, and the session
+// has no other operation outstanding meanwhile.
+struct chunked_response {
+    tcp::socket&    socket;
+    server_metrics& metrics;
+    tracing::trace* trace;
+    unsigned        version;
+    bool            keep_alive;
+    bool            started = false;
+    bool            failed  = false; // the response is incomplete; the connection must close
+
+    void write(const std::vector<char>& data, const char* content_type) {
+        tracing::scoped_span span{trace, "http_write_chunk", "http", "\"bytes\":" + std::to_string(data.size())};
+        if (!started) {
+            http::response<http::empty_body> res{http::status::ok, version};
+            res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+            res.set(http::field::content_type, content_type);
+            res.keep_alive(keep_alive);
+            res.chunked(true);
+            http::response_serializer<http::empty_body> sr{res};
+            started = true;
+            http::write_header(socket, sr);
+        }
+        if (!data.empty())
+            asio::write(socket, http::make_chunk(asio::buffer(data)));
+        metrics.bytes_out += data.size();
+    }
+
+    void finish(const std::vector<char>& data, const char* content_type) {
+        write(data, content_type);
+        tracing::scoped_span span{trace, "http_write_chunk", "http", "\"bytes\":0"};
+        asio::write(socket, http::make_chunk_last());
+    }
+};
+
+template <typename Send>
+void handle_request(::state& state, http::request<http::vector_body<char>> req, chunked_response& stream, Send&& send) {
     auto const error = [&req](http::status status, beast::string_view why) {
         http::response<http::string_body> res{status, req.version()};
         res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
@@ -330,75 +1903,227 @@ void handle_request(::state& state, tcp::socket& socket, http::request<http::vec
         return res;
     };
 
-    auto send = [&](const auto& msg) {
-        http::serializer<false, typename std::decay_t<decltype(msg)>::body_type> sr{msg};
-        http::write(socket, sr, ec);
-    };
-
     auto target = req.target();
     try {
-        if (target == "/wasmql/v1/query") {
+        if (target == "/wasmql/v1/ready") {
+            if (req.method() != http::verb::get)
+                return send(error(http::status::bad_request, "Unsupported HTTP-method\n"));
+            if (!*state.shared->ready)
+                return send(error(http::status::service_unavailable, "not ready\n"));
+            auto body = "ready\n"s;
+            return send(ok({body.begin(), body.end()}, "text/plain"));
+        } else if (target == "/wasmql/v1/reload") {
+            if (req.method() != http::verb::post)
+                return send(error(http::status::bad_request, "Unsupported HTTP-method\n"));
+            if (!state.shared->allow_reload)
+                return send(error(http::status::forbidden, "reload is disabled\n"));
+            return send(ok(reload_wasms(state), "application/json"));
+        } else if (target == "/metrics") {
+            if (req.method() != http::verb::get)
+                return send(error(http::status::bad_request, "Unsupported HTTP-method\n"));
+            return send(ok(metrics_text(*state.shared), "text/plain; version=0.0.4"));
+        } else if (target == "/wasmql/v1/cache") {
+            if (req.method() != http::verb::get)
+                return send(error(http::status::bad_request, "Unsupported HTTP-method\n"));
+            return send(ok(cache_stats(*state.shared), "application/json"));
+        } else if (target == "/wasmql/v1/traces") {
+            if (req.method() != http::verb::get)
+                return send(error(http::status::bad_request, "Unsupported HTTP-method\n"));
+            auto& sink = state.shared->trace_sink;
+            if (!sink || !sink->max_recent)
+                return send(error(http::status::not_found, "trace-buffer is 0\n"));
+            auto json = sink->recent_json();
+            return send(ok({json.begin(), json.end()}, "application/json"));
+        } else if (target == "/wasmql/v1/query") {
             if (req.method() != http::verb::post)
                 return send(error(http::status::bad_request, "Unsupported HTTP-method\n"));
             return send(ok(query(state, req.body()), "application/octet-stream"));
         } else if (target.starts_with("/v1/")) {
             if (req.method() != http::verb::post)
                 return send(error(http::status::bad_request, "Unsupported HTTP-method\n"));
-            return send(ok(legacy_query(state, std::string(target.begin(), target.end()), req.body()), "application/octet-stream"));
+            auto reply = legacy_query(state, std::string(target.begin(), target.end()), req.body(), [&](const std::vector<char>& data) {
+                stream.write(data, "application/octet-stream");
+            });
+            if (!stream.started)
+                return send(ok(std::move(reply), "application/octet-stream"));
+            return stream.finish(reply, "application/octet-stream");
         }
     } catch (const std::exception& e) {
+        ++state.shared->metrics->errors;
         elog("query failed: ${s}", ("s", e.what()));
+        if (stream.started) {
+            stream.failed = true;
+            return;
+        }
         return send(error(http::status::internal_server_error, "query failed: "s + e.what() + "\n"));
     } catch (...) {
+        ++state.shared->metrics->errors;
         elog("query failed: unknown exception");
+        if (stream.started) {
+            stream.failed = true;
+            return;
+        }
         return send(error(http::status::internal_server_error, "query failed: unknown exception\n"));
     }
 
     return send(error(http::status::not_found, "The resource '" + req.target().to_string() + "' was not found.\n"));
 }
 
-void accepted(::state& state, tcp::socket socket) {
-    beast::error_code ec;
+// One per connection. At most one read or write is outstanding at a time, so the handlers never run
+// concurrently even though they may run on different worker threads. Requests execute on the
+// thread_state of whichever worker completes the read.
+struct http_session : std::enable_shared_from_this<http_session> {
+    tcp::socket                            socket;
+    std::shared_ptr<const shared_state>    shared;
+    server_metrics&                        metrics;
+    beast::flat_buffer                     buffer;
+    http::request<http::vector_body<char>> req;
+    std::shared_ptr<void>                  res;
+    std::unique_ptr<tracing::trace>        trace;       // the current request's, if it's traced
+    tracing::clock::time_point             read_start;  // on a kept-alive connection this includes the idle time
+    tracing::clock::time_point             write_start; // unset if the response was streamed
+
+    http_session(tcp::socket socket, std::shared_ptr<const shared_state> shared)
+        : socket(std::move(socket))
+        , shared(std::move(shared))
+        , metrics(*this->shared->metrics) {
+        ++metrics.connections;
+    }
+
+    ~http_session() { --metrics.connections; }
 
-    beast::flat_buffer buffer;
-    for (;;) {
-        http::request<http::vector_body<char>> req;
-        http::read(socket, buffer, req, ec);
+    void start() { do_read(); }
+
+    void do_read() {
+        req         = {};
+        read_start  = tracing::clock::now();
+        write_start = {};
+        http::async_read(socket, buffer, req, [self = shared_from_this()](beast::error_code ec, std::size_t) { self->on_read(ec); });
+    }
+
+    void on_read(beast::error_code ec) {
         if (ec == http::error::end_of_stream)
-            break;
+            return do_close();
         if (ec)
             return fail(ec, "read");
+        ++metrics.requests;
+        metrics.bytes_in += req.body().size();
+        if (auto id = shared->start_trace(req.count("x-wasmql-trace"))) {
+            trace = std::make_unique<tracing::trace>(tracing::trace{id});
+            trace->add("http_read", "http", read_start, tracing::clock::now(), "\"bytes\":" + std::to_string(req.body().size()));
+        }
+        auto&            state = *thread_state;
+        chunked_response stream{socket, metrics, trace.get(), req.version(), req.keep_alive()};
+        state.trace = trace.get();
+        {
+            auto                 target = req.target().to_string();
+            tracing::scoped_span span{trace.get(), "handle_request", "http", "\"target\":\"" + tracing::json_escape(target) + "\""};
+            handle_request(state, std::move(req), stream, [this](auto&& msg) { send(std::move(msg)); });
+        }
+        state.trace = nullptr;
+        state.js_spans.clear();
+        if (stream.started)
+            on_write({}, !stream.keep_alive || stream.failed);
+    }
+
+    template <bool isRequest, class Body, class Fields>
+    void send(http::message<isRequest, Body, Fields>&& msg) {
+        auto sp = std::make_shared<http::message<isRequest, Body, Fields>>(std::move(msg));
+        res     = sp;
+        metrics.bytes_out += sp->body().size();
+        write_start = tracing::clock::now();
+        http::async_write(socket, *sp, [self = shared_from_this(), close = sp->need_eof()](beast::error_code ec, std::size_t) {
+            self->on_write(ec, close);
+        });
+    }
 
-        handle_request(state, socket, std::move(req), ec);
+    void on_write(beast::error_code ec, bool close) {
+        if (trace) {
+            if (write_start != tracing::clock::time_point{})
+                trace->add("http_write", "http", write_start, tracing::clock::now());
+            shared->trace_sink->write(*trace);
+            trace = nullptr;
+        }
         if (ec)
             return fail(ec, "write");
+        if (close)
+            return do_close();
+        res = nullptr;
+        do_read();
     }
-    socket.shutdown(tcp::socket::shutdown_send, ec);
-}
+
+    void do_close() {
+        beast::error_code ec;
+        socket.shutdown(tcp::socket::shutdown_send, ec);
+    }
+}; // http_session
 
 static abstract_plugin& _wasm_ql_plugin = app().register_plugin<wasm_ql_plugin>();
 
 using boost::signals2::scoped_connection;
 
-template <typename F>
-auto catch_and_log(F f) {
-    try {
-        return f();
-    } catch (const fc::exception& e) {
-        elog("${e}", ("e", e.to_detail_string()));
-    } catch (const std::exception& e) {
-        elog("${e}", ("e", e.what()));
-    } catch (...) {
-        elog("unknown exception");
+struct wasm_ql_plugin_impl : std::enable_shared_from_this<wasm_ql_plugin_impl> {
+    using work_guard = asio::executor_work_guard<asio::io_context::executor_type>;
+
+    std::atomic<bool>                   stopping       = false;
+    int                                 num_threads    = 1;
+    std::chrono::milliseconds           shutdown_drain = {}; // keep serving after /wasmql/v1/ready turns 503
+    std::string                         endpoint_address;
+    std::string                         endpoint_port;
+    std::shared_ptr<const shared_state> shared;
+    asio::io_context                    worker_ioc;
+    asio::io_context::strand            accept_strand{worker_ioc};
+    std::unique_ptr<tcp::acceptor>      acceptor; // on worker_ioc, so it keeps accepting after appbase's io_service stops
+    std::unique_ptr<work_guard>         work;
+    std::vector<std::thread>            threads;
+
+    ~wasm_ql_plugin_impl() { stop_threads(); }
+
+    void start_threads() {
+        work = std::make_unique<work_guard>(worker_ioc.get_executor());
+        std::vector<std::future<void>> ready;
+        for (int i = 0; i < num_threads; ++i) {
+            auto promise = std::make_shared<std::promise<void>>();
+            ready.push_back(promise->get_future());
+            threads.emplace_back([this, promise, i] {
+                std::unique_ptr<::state> state;
+                try {
+                    state = std::make_unique<::state>(shared);
+                    init_glue(*state);
+                    if (i == 0 && shared->precompile)
+                        precompile_wasms(*state);
+                    warmup(*state);
+                } catch (...) {
+                    promise->set_exception(std::current_exception());
+                    return;
+                }
+                promise->set_value();
+                thread_state = state.get();
+                while (!worker_ioc.stopped())
+                    catch_and_log([&] { worker_ioc.run(); });
+                thread_state = nullptr;
+            });
+            // the first worker fills module_cache while it warms up; the others reuse what it compiled
+            if (i == 0)
+                ready.back().wait();
+        }
+        try {
+            for (auto& f : ready)
+                f.get();
+        } catch (...) {
+            stop_threads();
+            throw;
+        }
+        ilog("started ${n} worker threads", ("n", num_threads));
     }
-}
 
-struct wasm_ql_plugin_impl : std::enable_shared_from_this<wasm_ql_plugin_impl> {
-    bool                           stopping = false;
-    std::string                    endpoint_address;
-    std::string                    endpoint_port;
-    std::unique_ptr<tcp::acceptor> acceptor;
-    std::unique_ptr<::state>       state;
+    void stop_threads() {
+        work.reset();
+        worker_ioc.stop();
+        for (auto& t : threads)
+            t.join();
+        threads.clear();
+    }
 
     void listen() {
         boost::system::error_code ec;
@@ -411,15 +2136,15 @@ struct wasm_ql_plugin_impl : std::enable_shared_from_this<wasm_ql_plugin_impl> {
 
         tcp::resolver resolver(app().get_io_service());
         auto          addr = resolver.resolve(tcp::resolver::query(tcp::v4(), endpoint_address, endpoint_port));
-        acceptor           = std::make_unique<tcp::acceptor>(app().get_io_service(), *addr.begin(), true);
+        acceptor           = std::make_unique<tcp::acceptor>(worker_ioc, *addr.begin(), true);
         acceptor->listen(boost::asio::socket_base::max_listen_connections, ec);
         check_ec("listen");
         do_accept();
     }
 
+    // The handler runs on accept_strand, so it never overlaps close_acceptor
     void do_accept() {
-        auto socket = std::make_shared<tcp::socket>(app().get_io_service());
-        acceptor->async_accept(*socket, [self = shared_from_this(), socket, this](auto ec) {
+        auto on_accept = [self = shared_from_this(), this](auto ec, tcp::socket socket) {
             if (stopping)
                 return;
             if (ec) {
@@ -427,9 +2152,38 @@ struct wasm_ql_plugin_impl : std::enable_shared_from_this<wasm_ql_plugin_impl> {
                     catch_and_log([&] { do_accept(); });
                 return;
             }
-            catch_and_log([&] { accepted(*state, std::move(*socket)); });
+            // the session's handlers run on whichever worker is idle when its I/O completes
+            catch_and_log([&] { std::make_shared<http_session>(std::move(socket), shared)->start(); });
             catch_and_log([&] { do_accept(); });
+        };
+        acceptor->async_accept(worker_ioc, asio::bind_executor(accept_strand, std::move(on_accept)));
+    }
+
+    void close_acceptor() {
+        std::promise<void> closed;
+        asio::post(accept_strand, [&] {
+            stopping = true;
+            boost::system::error_code ec;
+            acceptor->close(ec);
+            closed.set_value();
+        });
+        closed.get_future().wait();
+    }
+
+    // appbase has already stopped its io_service by the time plugins shut down, but the listener and
+    // the workers run on worker_ioc, so they keep serving while this waits. Another SIGINT or SIGTERM
+    // ends the wait early.
+    void drain() {
+        ilog("draining for ${ms} ms", ("ms", shutdown_drain.count()));
+        auto interrupted = std::make_shared<std::promise<void>>();
+        auto signals     = std::make_shared<asio::signal_set>(worker_ioc, SIGINT, SIGTERM);
+        signals->async_wait([interrupted, signals](auto ec, int) {
+            if (!ec)
+                interrupted->set_value();
         });
+        if (interrupted->get_future().wait_for(shutdown_drain) == std::future_status::ready)
+            ilog("drain interrupted");
+        signals->cancel();
     }
 }; // wasm_ql_plugin_impl
 
@@ -443,6 +2197,33 @@ void wasm_ql_plugin::set_program_options(options_description& cli, options_descr
     op("schema,s", bpo::value<std::string>()->default_value("chain"), "Database schema");
     op("query-config,q", bpo::value<std::string>()->default_value("../src/query-config.json"), "Query configuration");
     op("endpoint,e", bpo::value<std::string>()->default_value("localhost:8880"), "Endpoint to listen on");
+    op("threads", bpo::value<int>()->default_value(1), "Number of worker threads; each owns a JS context");
+    op("sql-connections", bpo::value<int>()->default_value(0), "Maximum number of database connections; 0 means one per thread");
+    op("fill-status-interval-ms", bpo::value<int>()->default_value(100), "How often to poll fill_status");
+    op("fill-status-channel", bpo::value<std::string>()->default_value(""),
+       "Also refresh fill_status as soon as a notification arrives on this channel");
+    op("query-timeout-ms", bpo::value<int>()->default_value(0), "Wall-clock limit for each wasm query; 0 is unlimited");
+    op("sql-timeout-ms", bpo::value<int>()->default_value(0), "statement_timeout for SQL run by wasm queries; 0 is unlimited");
+    op("query-memory-mb", bpo::value<int>()->default_value(0), "Linear memory limit for each wasm query, up to 4095; 0 is unlimited");
+    op("wasm-limit", bpo::value<std::vector<std::string>>()->composing(),
+       "Override the limits for one wasm: NAME:TIMEOUT_MS:SQL_TIMEOUT_MS:MEMORY_MB. May be repeated.");
+    op("response-cache-mb", bpo::value<int>()->default_value(0), "Memory for caching whole responses; 0 disables the cache");
+    op("result-cache-mb", bpo::value<int>()->default_value(0),
+       "Memory for caching exec_query results which only cover irreversible blocks; 0 disables the cache");
+    op("abi-cache-mb", bpo::value<int>()->default_value(32), "Memory for caching parsed ABIs; 0 disables the cache");
+    op("warmup-request", bpo::value<std::vector<std::string>>()->composing(),
+       "Run a request on every worker before accepting connections: TARGET=BODY or TARGET=@FILE. May be repeated.");
+    op("warmup-rounds", bpo::value<int>()->default_value(1), "How many times each worker runs the warmup requests");
+    op("shutdown-drain-ms", bpo::value<int>()->default_value(0),
+       "At shutdown, how long to keep serving after /wasmql/v1/ready starts returning 503, so load balancers can move traffic");
+    op("precompile-wasms", "Compile every *-server.wasm in the working directory before accepting requests");
+    op("allow-reload", "Accept POST /wasmql/v1/reload, which loads changed wasms without a restart");
+    op("native-get-table-rows", "Serve /v1/chain/get_table_rows on the host instead of in the legacy wasm");
+    op("trace-file", bpo::value<std::string>()->default_value(""),
+       "Write request traces to this file in the Chrome trace event format; load it in chrome://tracing or Perfetto");
+    op("trace-buffer", bpo::value<int>()->default_value(0), "How many recent traces GET /wasmql/v1/traces returns");
+    op("trace-sample-rate", bpo::value<double>()->default_value(0),
+       "Fraction of requests to trace when trace-file or trace-buffer is set. Requests with an x-wasmql-trace header are always traced.");
     op("console,C", "Show console output");
 }
 
@@ -450,24 +2231,111 @@ void wasm_ql_plugin::plugin_initialize(const variables_map& options) {
     try {
         JS_Init();
         auto ip_port         = options.at("endpoint").as<std::string>();
-        my->state            = std::make_unique<::state>();
-        my->state->console   = options.count("console");
-        my->state->schema    = options["schema"].as<std::string>();
+        auto shared          = std::make_shared<shared_state>();
+        shared->console      = options.count("console");
+        shared->schema       = options["schema"].as<std::string>();
+        shared->workers      = &my->worker_ioc;
+        my->num_threads      = options["threads"].as<int>();
         my->endpoint_port    = ip_port.substr(ip_port.find(':') + 1, ip_port.size());
         my->endpoint_address = ip_port.substr(0, ip_port.find(':'));
+        if (my->num_threads < 1)
+            throw std::runtime_error("threads must be at least 1");
+        int num_sql_connections = options["sql-connections"].as<int>();
+        if (num_sql_connections < 0)
+            throw std::runtime_error("sql-connections must not be negative");
+        if (!num_sql_connections)
+            num_sql_connections = my->num_threads;
+        shared->num_threads           = my->num_threads;
+        shared->native_get_table_rows = options.count("native-get-table-rows");
+        shared->precompile            = options.count("precompile-wasms");
+        shared->allow_reload          = options.count("allow-reload");
+        shared->module_cache          = std::make_shared<module_cache>();
+        shared->ready                 = std::make_shared<std::atomic<bool>>(false);
+        shared->metrics               = std::make_shared<server_metrics>();
+
+        auto non_negative = [&](const char* name) {
+            int value = options[name].as<int>();
+            if (value < 0)
+                throw std::runtime_error(name + " must not be negative"s);
+            return value;
+        };
+        shared->limits.timeout     = std::chrono::milliseconds(non_negative("query-timeout-ms"));
+        shared->limits.sql_timeout = std::chrono::milliseconds(non_negative("sql-timeout-ms"));
+        shared->limits.max_memory  = memory_limit_bytes(non_negative("query-memory-mb"));
+        if (options.count("wasm-limit"))
+            for (auto& s : options["wasm-limit"].as<std::vector<std::string>>())
+                shared->wasm_limits.insert(parse_wasm_limit(s));
+        shared->watchdog = std::make_shared<watchdog>();
+        if (auto mb = non_negative("response-cache-mb"))
+            shared->response_cache = std::make_shared<::response_cache>(size_t(mb) * 1024 * 1024);
+        if (auto mb = non_negative("abi-cache-mb"))
+            shared->abi_cache = std::make_shared<lru_cache<parsed_abi>>(size_t(mb) * 1024 * 1024);
+        if (auto mb = non_negative("result-cache-mb"))
+            shared->result_cache = std::make_shared<lru_cache<std::vector<char>>>(size_t(mb) * 1024 * 1024);
+        shared->warmup_rounds = non_negative("warmup-rounds");
+        if (options.count("warmup-request"))
+            for (auto& s : options["warmup-request"].as<std::vector<std::string>>())
+                shared->warmup_requests.push_back(parse_warmup_request(s));
+        auto trace_file           = options["trace-file"].as<std::string>();
+        auto trace_buffer         = non_negative("trace-buffer");
+        shared->trace_sample_rate = options["trace-sample-rate"].as<double>();
+        if (!(shared->trace_sample_rate >= 0 && shared->trace_sample_rate <= 1))
+            throw std::runtime_error("trace-sample-rate must be between 0 and 1");
+        if (!trace_file.empty() || trace_buffer) {
+            shared->trace_sink    = std::make_shared<tracing::sink>(trace_file, trace_buffer);
+            shared->num_traceable = std::make_shared<std::atomic<uint64_t>>(0);
+        }
 
         auto x = read_string(options["query-config"].as<std::string>().c_str());
         try {
-            json_to_native(my->state->config, x);
+            json_to_native(shared->config, x);
         } catch (const std::exception& e) {
             throw std::runtime_error("error processing " + options["query-config"].as<std::string>() + ": " + e.what());
         }
-        my->state->config.prepare();
-
-        init_glue(*my->state);
+        shared->config.prepare();
+        shared->sql_pool = std::make_shared<pg::pool>(
+            num_sql_connections, "", [shared = shared.get()](pg::connection& conn) { prepare_queries(conn, *shared); });
+        shared->fill_status = std::make_shared<fill_status_listener>(
+            shared->schema, options["fill-status-channel"].as<std::string>(),
+            std::chrono::milliseconds(options["fill-status-interval-ms"].as<int>()));
+        shared->fill_status->on_head_change = [shared = shared.get()](const fill_status& status) {
+            if (shared->response_cache)
+                shared->response_cache->erase_if([&](const cached_response& r) { return r.stale(status.head_id); });
+        };
+        my->shutdown_drain = std::chrono::milliseconds(non_negative("shutdown-drain-ms"));
+        my->shared         = std::move(shared);
     }
     FC_LOG_AND_RETHROW()
 }
 
-void wasm_ql_plugin::plugin_startup() { my->listen(); }
-void wasm_ql_plugin::plugin_shutdown() { my->stopping = true; }
+// Connections are opened and their statements prepared before the workers warm up, and the listener
+// only opens once they have. /wasmql/v1/ready reports whether this instance should get traffic.
+void wasm_ql_plugin::plugin_startup() {
+    {
+        // reports database problems at startup
+        std::vector<pg::pool::lease> leases;
+        for (size_t i = 0; i < std::min(my->shared->sql_pool->max_size, size_t(my->num_threads)); ++i)
+            leases.push_back(my->shared->sql_pool->checkout());
+    }
+    my->shared->fill_status->start();
+    my->shared->watchdog->start();
+    my->start_threads();
+    my->listen();
+    *my->shared->ready = true;
+    ilog("ready");
+}
+
+// Requests keep being accepted for shutdown-drain-ms after /wasmql/v1/ready fails, so health checks
+// see the 503 and move traffic elsewhere before the listener closes.
+void wasm_ql_plugin::plugin_shutdown() {
+    *my->shared->ready = false;
+    if (my->acceptor) {
+        if (my->shutdown_drain.count())
+            my->drain();
+        my->close_acceptor();
+    }
+    my->stopping = true;
+    my->stop_threads();
+    my->shared->watchdog->stop();
+    my->shared->fill_status->stop();
+}